@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "geometry.h"
+#include "scene.h"
+
+// Moves a sphere's rest center to center from frame on, until a later key moves it again
+struct SphereKey {
+    uint32_t frame;
+    uint32_t sphere;
+    Vec3f center;
+};
+
+// Rotation followed by a translation, maps p to rotation * p + translation
+struct RigidTransform {
+    Vec3f rows[3] = { Vec3f(1, 0, 0), Vec3f(0, 1, 0), Vec3f(0, 0, 1) };
+    Vec3f translation = Vec3f(0, 0, 0);
+
+    Vec3f apply(const Vec3f& p) const { return Vec3f(rows[0] * p, rows[1] * p, rows[2] * p) + translation; }
+    // This transform followed by next
+    RigidTransform then(const RigidTransform& next) const;
+    static RigidTransform translate(const Vec3f& offset);
+    // Rotation by degrees around the axis through pivot, counter-clockwise looking down the axis
+    static RigidTransform rotate(const Vec3f& axis, float degrees, const Vec3f& pivot);
+};
+
+// Spheres [first, first + count) of every range. Group 0 is "all" and holds every sphere.
+struct SphereGroup {
+    std::string name;
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+};
+
+// Places a group with transform from frame on, until a later key for the group replaces it. Transforms are not
+// cumulative, they map the rest centers. Keys of the same group and frame are chained in file order.
+struct TransformKey {
+    uint32_t frame;
+    uint32_t group;
+    RigidTransform transform;
+};
+
+// Sphere motion of a sequence. A sphere is drawn at its rest center mapped by the current transform of every
+// group it is in, in the order the groups were defined. Keys are sorted by frame.
+struct Animation {
+    std::vector<SphereKey> keys;
+    std::vector<SphereGroup> groups;
+    std::vector<TransformKey> transforms;
+    uint32_t frame_count = 0;
+
+    // Applies the keys of frame and returns how many spheres moved. Frames have to be applied in order, from 0.
+    // The rest centers are taken from the scene on frame 0. Applied frame after frame, this touches only the
+    // spheres that move.
+    size_t apply(uint32_t frame, Scene& scene);
+
+private:
+    std::vector<Vec3f> rest;
+    std::vector<RigidTransform> current;
+    // Set for groups that were transformed at least once
+    std::vector<bool> placed;
+    // Frame each sphere was last moved in, so spheres in several moving groups are counted once
+    std::vector<uint32_t> touched;
+};
+
+// Reads a text file with one key per line, spheres counted in the order they were added to the scene:
+//   frame sphere x y z                       moves the rest center of a sphere
+//   group name first count                   adds the spheres [first, first + count) to a group, may be repeated
+//   frame translate group x y z              places a group with a translation
+//   frame rotate group ax ay az degrees [px py pz]   places a group with a rotation around an axis through p
+// Groups have to be defined before they are used, "all" is predefined. Empty lines and lines starting with #
+// are skipped. Prints an error and returns false on failure.
+bool load_animation(const char* path, size_t sphere_count, Animation& animation);
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Array that either owns its elements like a std::vector or views elements that live elsewhere, typically in a
+// memory mapped scene file. Reads never copy. The first mutation of a view copies the elements into owned storage,
+// so code that edits geometry (BVH builds, refits) works the same on loaded and on generated scenes.
+// Copies of a view are views of the same memory, whoever made the view has to keep that memory alive.
+template <typename T>
+class Buffer {
+public:
+    Buffer() {}
+    Buffer(const Buffer& other) { *this = other; }
+    Buffer(Buffer&& other) { *this = std::move(other); }
+    Buffer& operator=(const Buffer& other) {
+        if (this == &other) return *this;
+        storage = other.storage;
+        viewing = other.viewing;
+        ptr = viewing ? other.ptr : storage.data();
+        count = other.count;
+        return *this;
+    }
+    Buffer& operator=(Buffer&& other) {
+        if (this == &other) return *this;
+        storage = std::move(other.storage);
+        viewing = other.viewing;
+        ptr = viewing ? other.ptr : storage.data();
+        count = other.count;
+        other.clear();
+        return *this;
+    }
+
+    static Buffer view(const T* data, size_t size) {
+        Buffer b;
+        b.viewing = true;
+        b.ptr = const_cast<T*>(data);
+        b.count = size;
+        return b;
+    }
+    bool is_view() const { return viewing; }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T* data() const { return ptr; }
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + count; }
+    const T& operator[](size_t i) const {
+        assert(i < count);
+        return ptr[i];
+    }
+
+    T* data() { own(); return ptr; }
+    T* begin() { own(); return ptr; }
+    T* end() { own(); return ptr + count; }
+    T& operator[](size_t i) {
+        assert(i < count);
+        own();
+        return ptr[i];
+    }
+
+    void clear() {
+        storage.clear();
+        viewing = false;
+        sync();
+    }
+    void reserve(size_t n) {
+        own();
+        storage.reserve(n);
+        sync();
+    }
+    void resize(size_t n) {
+        own();
+        storage.resize(n);
+        sync();
+    }
+    void resize(size_t n, const T& value) {
+        own();
+        storage.resize(n, value);
+        sync();
+    }
+    void push_back(const T& value) {
+        own();
+        storage.push_back(value);
+        sync();
+    }
+    template <typename It>
+    void assign(It first, It last) {
+        storage.assign(first, last);
+        viewing = false;
+        sync();
+    }
+
+private:
+    void own() {
+        if (!viewing) return;
+        storage.assign(ptr, ptr + count);
+        viewing = false;
+        sync();
+    }
+    void sync() {
+        ptr = storage.data();
+        count = storage.size();
+    }
+
+    std::vector<T> storage;
+    T* ptr = nullptr;
+    size_t count = 0;
+    bool viewing = false;
+};
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "buffer.h"
+#include "counters.h"
+#include "geometry.h"
+
+struct AABB {
+    AABB()
+        : min(Vec3f(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max())),
+        max(Vec3f(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max())) {}
+    AABB(const Vec3f& min, const Vec3f& max) : min(min), max(max) {}
+
+    void expand(const Vec3f& p) {
+        min = Vec3f(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = Vec3f(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+    void expand(const AABB& b) {
+        if (b.empty()) return;
+        expand(b.min);
+        expand(b.max);
+    }
+    Vec3f centroid() const { return (min + max) * 0.5f; }
+    bool empty() const { return min.x > max.x; }
+    float surface_area() const {
+        if (empty()) return 0.f;
+        Vec3f d = max - min;
+        return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    // Slab test, returns the entry distance in tmin. inv_rd is 1/rd per component.
+    bool ray_intersect(const Vec3f& ro, const Vec3f& inv_rd, float t_max, float& tmin) const {
+        float tx1 = (min.x - ro.x) * inv_rd.x, tx2 = (max.x - ro.x) * inv_rd.x;
+        float ty1 = (min.y - ro.y) * inv_rd.y, ty2 = (max.y - ro.y) * inv_rd.y;
+        float tz1 = (min.z - ro.z) * inv_rd.z, tz2 = (max.z - ro.z) * inv_rd.z;
+        tmin = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::max(std::min(tz1, tz2), 0.f));
+        float tmax = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::min(std::max(tz1, tz2), t_max));
+        return tmin <= tmax;
+    }
+
+    Vec3f min, max;
+};
+
+// 32 byte node. Inner nodes store the index of their left child in left_first (the right child follows it),
+// leaves store the first entry of their primitive range in prim_indices.
+struct BVHNode {
+    AABB bounds;
+    uint32_t left_first;
+    uint32_t count;
+    bool is_leaf() const { return count > 0; }
+};
+
+struct BVH {
+    Buffer<BVHNode> nodes;
+    Buffer<uint32_t> prim_indices;
+
+    static const int BIN_COUNT = 16;
+    static const int MAX_LEAF_SIZE = 4;
+    static const int MAX_DEPTH = 64;
+
+    // Builds the hierarchy over the given primitive bounds with a binned surface area heuristic.
+    void build(const std::vector<AABB>& prim_bounds) {
+        nodes.clear();
+        prim_indices.resize(prim_bounds.size());
+        for (size_t i = 0; i < prim_indices.size(); i++) prim_indices[i] = i;
+        if (prim_bounds.empty()) return;
+
+        std::vector<Vec3f> centroids(prim_bounds.size());
+        for (size_t i = 0; i < prim_bounds.size(); i++) centroids[i] = prim_bounds[i].centroid();
+
+        nodes.reserve(2 * prim_bounds.size());
+        nodes.push_back(BVHNode{ AABB(), 0, (uint32_t)prim_bounds.size() });
+        subdivide(0, prim_bounds, centroids, 1);
+    }
+
+    // Recomputes the node bounds bottom-up after primitives moved, keeping the tree as it is. leaf_bounds(first, count)
+    // returns the bounds of the primitives prim_indices[first, first + count). Children are always stored after
+    // their parent, so one backwards pass over the nodes is enough.
+    template <typename LeafBoundsFn>
+    void refit(LeafBoundsFn leaf_bounds) {
+        for (size_t i = nodes.size(); i-- > 0;) {
+            BVHNode& node = nodes[i];
+            if (node.is_leaf()) {
+                node.bounds = leaf_bounds(node.left_first, node.count);
+            }
+            else {
+                AABB bounds = nodes[node.left_first].bounds;
+                bounds.expand(nodes[node.left_first + 1].bounds);
+                node.bounds = bounds;
+            }
+        }
+    }
+
+    // Expected cost of a random ray hitting the root, with the cost model of the build. Grows as refits
+    // stretch the nodes over primitives that moved apart.
+    float sah_cost() const {
+        if (nodes.empty() || nodes[0].bounds.surface_area() <= 0.f) return 0.f;
+        double cost = 0;
+        for (const BVHNode& node : nodes) cost += double(node.bounds.surface_area()) * (node.is_leaf() ? node.count : 1);
+        return float(cost / nodes[0].bounds.surface_area());
+    }
+
+    // Visits the leaves front to back along the ray. leaf(first, count, t_max) tests the primitives
+    // prim_indices[first, first + count) and shrinks t_max to the closest hit it finds.
+    template <typename LeafFn>
+    void traverse(const Vec3f& ro, const Vec3f& rd, float& t_max, LeafFn leaf) const {
+        if (nodes.empty()) return;
+        const Vec3f inv_rd(1.f / rd.x, 1.f / rd.y, 1.f / rd.z);
+        struct Entry { uint32_t node; float t_entry; };
+        Entry stack[MAX_DEPTH];
+        int stack_size = 0;
+        float t_root;
+        if (!nodes[0].bounds.ray_intersect(ro, inv_rd, t_max, t_root)) return;
+        stack[stack_size++] = { 0, t_root };
+
+        while (stack_size > 0) {
+            const Entry entry = stack[--stack_size];
+            RT_COUNT(node_visits, 1);
+            // t_max may have shrunk since the node was pushed
+            if (entry.t_entry > t_max) continue;
+            const BVHNode& node = nodes[entry.node];
+            if (node.is_leaf()) {
+                leaf(node.left_first, node.count, t_max);
+                continue;
+            }
+            uint32_t near_child = node.left_first, far_child = node.left_first + 1;
+            float t_near, t_far;
+            bool hit_near = nodes[near_child].bounds.ray_intersect(ro, inv_rd, t_max, t_near);
+            bool hit_far = nodes[far_child].bounds.ray_intersect(ro, inv_rd, t_max, t_far);
+            if (hit_near && hit_far && t_far < t_near) {
+                std::swap(near_child, far_child);
+                std::swap(t_near, t_far);
+            }
+            // The node popped last is visited first, so push the far child before the near one
+            if (hit_near && hit_far) {
+                stack[stack_size++] = { far_child, t_far };
+                stack[stack_size++] = { near_child, t_near };
+            }
+            else if (hit_near) stack[stack_size++] = { near_child, t_near };
+            else if (hit_far) stack[stack_size++] = { far_child, t_far };
+        }
+    }
+
+    // Any-hit query. leaf(first, count) returns true as soon as one of its primitives blocks the ray
+    // before t_max, which ends the traversal. Children are visited in memory order.
+    template <typename LeafFn>
+    bool occluded(const Vec3f& ro, const Vec3f& rd, float t_max, LeafFn leaf) const {
+        if (nodes.empty()) return false;
+        const Vec3f inv_rd(1.f / rd.x, 1.f / rd.y, 1.f / rd.z);
+        uint32_t stack[MAX_DEPTH];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            const BVHNode& node = nodes[stack[--stack_size]];
+            RT_COUNT(node_visits, 1);
+            float t_entry;
+            if (!node.bounds.ray_intersect(ro, inv_rd, t_max, t_entry)) continue;
+            if (node.is_leaf()) {
+                if (leaf(node.left_first, node.count)) return true;
+                continue;
+            }
+            stack[stack_size++] = node.left_first + 1;
+            stack[stack_size++] = node.left_first;
+        }
+        return false;
+    }
+
+private:
+    // Leaves list their primitives in ascending order, so the first of several equally close hits
+    // in a leaf is the one with the lowest index
+    void make_leaf(uint32_t node_index) {
+        const BVHNode& node = nodes[node_index];
+        std::sort(prim_indices.begin() + node.left_first, prim_indices.begin() + node.left_first + node.count);
+    }
+
+    void subdivide(uint32_t node_index, const std::vector<AABB>& prim_bounds, const std::vector<Vec3f>& centroids, int depth) {
+        uint32_t first = nodes[node_index].left_first, count = nodes[node_index].count;
+
+        AABB bounds, centroid_bounds;
+        for (uint32_t i = first; i < first + count; i++) {
+            bounds.expand(prim_bounds[prim_indices[i]]);
+            centroid_bounds.expand(centroids[prim_indices[i]]);
+        }
+        nodes[node_index].bounds = bounds;
+        if (count <= MAX_LEAF_SIZE || depth >= MAX_DEPTH - 1) return make_leaf(node_index);
+
+        // Bin the centroids along every axis and pick the cheapest plane
+        int best_axis = -1, best_split = 0;
+        float best_cost = std::numeric_limits<float>::max();
+        for (int axis = 0; axis < 3; axis++) {
+            float lo = centroid_bounds.min[axis], hi = centroid_bounds.max[axis];
+            if (hi <= lo) continue;
+            float scale = BIN_COUNT / (hi - lo);
+
+            AABB bin_bounds[BIN_COUNT];
+            uint32_t bin_count[BIN_COUNT] = {};
+            for (uint32_t i = first; i < first + count; i++) {
+                int b = std::min(BIN_COUNT - 1, int((centroids[prim_indices[i]][axis] - lo) * scale));
+                bin_count[b]++;
+                bin_bounds[b].expand(prim_bounds[prim_indices[i]]);
+            }
+
+            // Sweep from the right to get the area of every right hand side, then from the left
+            float right_area[BIN_COUNT];
+            uint32_t right_count[BIN_COUNT];
+            AABB acc;
+            uint32_t n = 0;
+            for (int b = BIN_COUNT - 1; b > 0; b--) {
+                acc.expand(bin_bounds[b]);
+                n += bin_count[b];
+                right_area[b] = acc.surface_area();
+                right_count[b] = n;
+            }
+            acc = AABB();
+            n = 0;
+            for (int b = 0; b < BIN_COUNT - 1; b++) {
+                acc.expand(bin_bounds[b]);
+                n += bin_count[b];
+                if (n == 0 || right_count[b + 1] == 0) continue;
+                float cost = acc.surface_area() * n + right_area[b + 1] * right_count[b + 1];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = b;
+                }
+            }
+        }
+
+        // A traversal step is costed like one intersection test, splitting has to beat testing everything
+        float leaf_cost = bounds.surface_area() * count;
+        if (best_axis < 0 || bounds.surface_area() + best_cost >= leaf_cost) return make_leaf(node_index);
+
+        float lo = centroid_bounds.min[best_axis];
+        float scale = BIN_COUNT / (centroid_bounds.max[best_axis] - lo);
+        uint32_t* middle = std::partition(prim_indices.data() + first, prim_indices.data() + first + count, [&](uint32_t p) {
+            return std::min(BIN_COUNT - 1, int((centroids[p][best_axis] - lo) * scale)) <= best_split;
+        });
+        uint32_t left_count = middle - (prim_indices.data() + first);
+        if (left_count == 0 || left_count == count) return make_leaf(node_index);
+
+        uint32_t left = nodes.size();
+        nodes.push_back(BVHNode{ AABB(), first, left_count });
+        nodes.push_back(BVHNode{ AABB(), first + left_count, count - left_count });
+        nodes[node_index].left_first = left;
+        nodes[node_index].count = 0;
+        subdivide(left, prim_bounds, centroids, depth + 1);
+        subdivide(left + 1, prim_bounds, centroids, depth + 1);
+    }
+};
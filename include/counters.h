@@ -0,0 +1,104 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+// What the rays of one pixel cost. Only counted in builds configured with -DRAYTRACER_COUNTERS=ON, everywhere
+// else RT_COUNT expands to nothing and CounterScope is empty, so the hot paths carry no trace of them.
+struct RayCounters {
+    uint64_t primary_rays = 0;
+    uint64_t shadow_rays = 0;
+    uint64_t reflection_rays = 0;
+    uint64_t refraction_rays = 0;
+    uint64_t sphere_tests = 0;
+    // BVH nodes popped during traversal, sphere and mesh BVHs alike
+    uint64_t node_visits = 0;
+    // Time stamp counter ticks on x86, nanoseconds elsewhere
+    uint64_t cycles = 0;
+
+    // Part k of n equal parts, the first parts get the remainders
+    RayCounters split(uint64_t n, uint64_t k) const {
+        RayCounters part;
+        auto share = [&](uint64_t total) { return total / n + (k < total % n); };
+        part.primary_rays = share(primary_rays);
+        part.shadow_rays = share(shadow_rays);
+        part.reflection_rays = share(reflection_rays);
+        part.refraction_rays = share(refraction_rays);
+        part.sphere_tests = share(sphere_tests);
+        part.node_visits = share(node_visits);
+        part.cycles = share(cycles);
+        return part;
+    }
+
+    RayCounters& operator+=(const RayCounters& o) {
+        primary_rays += o.primary_rays;
+        shadow_rays += o.shadow_rays;
+        reflection_rays += o.reflection_rays;
+        refraction_rays += o.refraction_rays;
+        sphere_tests += o.sphere_tests;
+        node_visits += o.node_visits;
+        cycles += o.cycles;
+        return *this;
+    }
+};
+
+inline uint64_t read_cycle_counter() {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+#ifdef RAYTRACER_COUNTERS
+const bool COUNTERS_ENABLED = true;
+
+// Counted by the thread doing the work, render() charges the difference to the pixels
+extern thread_local RayCounters thread_counters;
+#define RT_COUNT(counter, n) (thread_counters.counter += (n))
+
+// What the current thread counted since the scope started
+class CounterScope {
+public:
+    CounterScope() : start(thread_counters), start_cycles(read_cycle_counter()) {}
+    RayCounters elapsed() const {
+        RayCounters d;
+        d.primary_rays = thread_counters.primary_rays - start.primary_rays;
+        d.shadow_rays = thread_counters.shadow_rays - start.shadow_rays;
+        d.reflection_rays = thread_counters.reflection_rays - start.reflection_rays;
+        d.refraction_rays = thread_counters.refraction_rays - start.refraction_rays;
+        d.sphere_tests = thread_counters.sphere_tests - start.sphere_tests;
+        d.node_visits = thread_counters.node_visits - start.node_visits;
+        d.cycles = read_cycle_counter() - start_cycles;
+        return d;
+    }
+
+private:
+    RayCounters start;
+    uint64_t start_cycles;
+};
+#else
+const bool COUNTERS_ENABLED = false;
+
+#define RT_COUNT(counter, n) ((void)0)
+
+class CounterScope {
+public:
+    RayCounters elapsed() const { return RayCounters(); }
+};
+#endif
+
+// Writes prefix_heatmap.jpg, cycles per pixel in false colour scaled to the 99th percentile, prefix_counters.csv
+// with one row per pixel and prefix_counters.json with totals and per pixel statistics. Prints an error and
+// returns false on failure.
+bool write_counters(const std::string& prefix, int width, int height, const std::vector<RayCounters>& pixels);
@@ -0,0 +1,85 @@
+#pragma once
+
+#define _USE_MATH_DEFINES
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "geometry.h"
+#include "mapped_file.h"
+
+enum class EnvmapLookup { Exact, Cube };
+
+// Equirectangular environment image. It can be resampled into a cube map at load time, so a lookup costs
+// a division, a few multiplies and one fetch instead of acos, atan2 and the conversions.
+//
+// Every cube texel holds the exact lookup of the direction through its center. A cube face spans 90 degrees over
+// face_size texels, so a direction is within atan(sqrt(2) / face_size) radians of the texel center it picks.
+// With the default face_size of width / 4 that is below 0.9 equirectangular texels (2 pi / width) at the
+// equator, so the cube returns the exact texel or a direct neighbour there. Towards the poles the
+// equirectangular texels shrink to a fraction of that angle horizontally, and the lookup can be several texels
+// off. The default cube holds 1.5 times the texels of the image: about 260 MB of floats for a 7616x3808 map.
+//
+// The converted float data can be written to a binary cache file and mapped back in on later runs,
+// pixels and cube then point straight into the mapping.
+struct Envmap {
+    int width = 0, height = 0;
+    const Vec3f* pixels = nullptr;
+    int face_size = 0;
+    // Faces +x, -x, +y, -y, +z, -z, each face_size x face_size texels. Null until build_cube().
+    const Vec3f* cube = nullptr;
+    EnvmapLookup lookup = EnvmapLookup::Exact;
+
+    // Loads an RGB image, prints an error and returns false on failure
+    bool load(const char* path);
+    // face_size <= 0 picks width / 4
+    void build_cube(int face_size, int threads);
+
+    // Maps cache_path if it was written for the current size and mtime of path. Otherwise decodes path,
+    // builds the cube map when with_cube is set and rewrites the cache. Sets from_cache if nothing was decoded.
+    bool load_cached(const char* path, const char* cache_path, bool with_cube, int threads, bool& from_cache);
+    bool write_cache(const char* cache_path, const FileStamp& source) const;
+    // False if the file is missing, broken or was written for another source
+    bool map_cache(const char* cache_path, const FileStamp& source);
+
+    Vec3f sample(const Vec3f& rd) const {
+        return lookup == EnvmapLookup::Cube && cube ? sample_cube(rd) : sample_exact(rd);
+    }
+
+    Vec3f sample_exact(const Vec3f& rd) const {
+        // Convert direction vector to spherical coordinates
+        float theta = std::acos(rd.y);  // Inclination angle, theta = arccos(cos(y_axis * rd.y)) by def of dot product
+        float phi = std::atan2(rd.z, rd.x);  // Angle from the x axis, counterclockwise
+
+        // Map spherical coordinates to pixel coordinates
+        int u = (phi + M_PI) / (2 * M_PI) * width;
+        int v = theta / M_PI * height;
+
+        // Clamp pixel coordinates to valid range
+        u = std::max(0, std::min(u, width - 1));
+        v = std::max(0, std::min(v, height - 1));
+
+        return pixels[u + v * width];
+    }
+
+    // rd does not have to be normalized
+    Vec3f sample_cube(const Vec3f& rd) const {
+        float ax = fabsf(rd.x), ay = fabsf(rd.y), az = fabsf(rd.z);
+        int face;
+        float ma, sc, tc;
+        if (ax >= ay && ax >= az) { face = rd.x > 0 ? 0 : 1; ma = ax; sc = rd.x > 0 ? -rd.z : rd.z; tc = -rd.y; }
+        else if (ay >= az) { face = rd.y > 0 ? 2 : 3; ma = ay; sc = rd.x; tc = rd.y > 0 ? rd.z : -rd.z; }
+        else { face = rd.z > 0 ? 4 : 5; ma = az; sc = rd.z > 0 ? rd.x : -rd.x; tc = -rd.y; }
+
+        float half = 0.5f * face_size;
+        float scale = half / ma;
+        int u = std::max(0, std::min(int(sc * scale + half), face_size - 1));
+        int v = std::max(0, std::min(int(tc * scale + half), face_size - 1));
+        return cube[(face * face_size + v) * face_size + u];
+    }
+
+private:
+    std::vector<Vec3f> pixel_storage;
+    std::vector<Vec3f> cube_storage;
+    MappedFile mapping;
+};
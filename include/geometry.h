@@ -17,7 +17,7 @@ struct vec{
         assert(i < DIM);
         return data[i];
     }
-    const T& operator[](const size_t i) {
+    const T& operator[](const size_t i) const {
         assert(i < DIM);
         return data[i];
     }
@@ -82,11 +82,11 @@ vec<DIM, T> operator+(vec<DIM, T> lhs, const vec<DIM, T>& rhs) {
 }
 
 template<size_t DIM, typename T>
-void operator+=(vec<DIM, T> lhs, const vec<DIM, T>& rhs) {
+vec<DIM, T>& operator+=(vec<DIM, T>& lhs, const vec<DIM, T>& rhs) {
     for (size_t i = 0; i < DIM; i++) {
         lhs[i] += rhs[i];
     }
-    return;
+    return lhs;
 }
 
 
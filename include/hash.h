@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "geometry.h"
+
+// 128 bit content hash. Only the values that go in are hashed, never padding or pointers, so a digest is the same
+// in every run and build on little endian machines.
+struct Digest {
+    uint64_t hi = 0, lo = 0;
+    std::string hex() const;
+    bool operator==(const Digest& other) const { return hi == other.hi && lo == other.lo; }
+};
+
+class Hasher {
+public:
+    void bytes(const void* data, size_t size);
+    void u64(uint64_t value) { bytes(&value, sizeof(value)); }
+    void f32(float value) { bytes(&value, sizeof(value)); }
+    void vec(const Vec3f& v) { f32(v.x); f32(v.y); f32(v.z); }
+    Digest digest() const;
+
+private:
+    void word(uint64_t w);
+    uint64_t a = 0x9e3779b97f4a7c15ull, b = 0xc2b2ae3d27d4eb4full;
+    uint64_t length = 0;
+    uint8_t tail[8];
+    size_t tail_size = 0;
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "geometry.h"
+
+struct ImageWriterStats {
+    int images = 0;
+    int failed = 0;
+    // Summed over all encoder threads
+    double encode_ms = 0;
+    double max_encode_ms = 0;
+    // How long producers were blocked on a full queue
+    double wait_ms = 0;
+};
+
+// Receives the encoded image on the encoder thread, ok is false when encoding failed
+typedef std::function<void(bool ok, const std::vector<unsigned char>& jpeg)> EncodedFn;
+
+// Writes size bytes to path through a temporary file renamed over it. Prints an error and returns false on failure.
+bool write_file(const std::string& path, const void* data, size_t size);
+
+// Encodes and writes framebuffers on a pool of encoder threads, so rendering the next frame overlaps with
+// writing the last one. The queue holds at most capacity framebuffers, producers wait when it is full.
+class ImageWriter {
+public:
+    ImageWriter(int threads, size_t capacity);
+    ~ImageWriter();
+    ImageWriter(const ImageWriter&) = delete;
+    ImageWriter& operator=(const ImageWriter&) = delete;
+
+    // Takes over the framebuffer and queues it for writing as a JPEG. Failures are reported on std::cerr
+    // and counted in the stats. Images queued after finish are rejected that way and false is returned.
+    // done, if given, also gets the JPEG once the file is written, or ok false.
+    bool write_jpg(const std::string& path, int width, int height, std::vector<Vec3uc> framebuffer, int quality, EncodedFn done = EncodedFn());
+    // Like write_jpg, but hands the JPEG to done instead of writing a file. A rejected image calls done with ok false.
+    bool encode_jpg(int width, int height, std::vector<Vec3uc> framebuffer, int quality, EncodedFn done);
+    // Waits until every queued image is written and stops the encoder threads
+    ImageWriterStats finish();
+
+private:
+    struct Job {
+        // Empty when the image only goes to done
+        std::string path;
+        int width, height, quality;
+        std::vector<Vec3uc> framebuffer;
+        EncodedFn done;
+    };
+    bool push(Job job);
+    void run();
+
+    std::vector<std::thread> encoders;
+    std::deque<Job> queue;
+    size_t capacity;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable job_ready, slot_free;
+    ImageWriterStats stats;
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <utility>
+
+// Read-only memory mapping of a whole file. The mapping is released with the object.
+class MappedFile {
+public:
+    MappedFile() {}
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Returns false if the file can not be opened or mapped, or is empty, since an empty mapping is not possible
+    bool open(const char* path);
+    void close();
+    void swap(MappedFile& other);
+
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return length; }
+    bool is_open() const { return ptr != nullptr; }
+
+private:
+    const uint8_t* ptr = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#endif
+};
+
+struct FileStamp {
+    uint64_t size;
+    int64_t mtime;
+};
+
+// Size and modification time of a file, false if it does not exist
+bool file_stamp(const char* path, FileStamp& stamp);
+
+// Sections of the binary caches start on multiples of this, enough for any SIMD load and a cache line
+const uint64_t FILE_SECTION_ALIGNMENT = 64;
+
+inline uint64_t align_up(uint64_t offset) {
+    return (offset + FILE_SECTION_ALIGNMENT - 1) / FILE_SECTION_ALIGNMENT * FILE_SECTION_ALIGNMENT;
+}
+
+// Writes zeros for the bytes [from, to) of a file being written sequentially
+bool write_padding(FILE* f, uint64_t from, uint64_t to);
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "buffer.h"
+#include "bvh.h"
+#include "geometry.h"
+#include "objects.h"
+
+// Per ray setup of the watertight ray/triangle test (Woop, Benthin and Wald, "Watertight Ray/Triangle
+// Intersection", JCGT 2013). The ray is sheared so it runs along +z, then the triangle is tested in 2D with
+// edge functions that fall back to double precision when they are exactly 0. Rays passing through a shared
+// edge or vertex always hit at least one of the triangles around it.
+struct WatertightRay {
+    Vec3f ro;
+    int kx, ky, kz;
+    float sx, sy, sz;
+
+    WatertightRay(const Vec3f& ro, const Vec3f& rd) : ro(ro) {
+        float ax = fabsf(rd.x), ay = fabsf(rd.y), az = fabsf(rd.z);
+        kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        // Keep the winding when the dominant direction is negative
+        if (rd[kz] < 0.f) std::swap(kx, ky);
+        sx = rd[kx] / rd[kz];
+        sy = rd[ky] / rd[kz];
+        sz = 1.f / rd[kz];
+    }
+
+    // Hits from both sides are reported, t is only written for hits in (0, t_max)
+    bool intersect(const Vec3f& a, const Vec3f& b, const Vec3f& c, float t_max, float& t, float& u, float& v) const {
+        const Vec3f A = a - ro, B = b - ro, C = c - ro;
+        const float Ax = A[kx] - sx * A[kz], Ay = A[ky] - sy * A[kz];
+        const float Bx = B[kx] - sx * B[kz], By = B[ky] - sy * B[kz];
+        const float Cx = C[kx] - sx * C[kz], Cy = C[ky] - sy * C[kz];
+
+        float U = Cx * By - Cy * Bx;
+        float V = Ax * Cy - Ay * Cx;
+        float W = Bx * Ay - By * Ax;
+        if (U == 0.f || V == 0.f || W == 0.f) {
+            U = float(double(Cx) * double(By) - double(Cy) * double(Bx));
+            V = float(double(Ax) * double(Cy) - double(Ay) * double(Cx));
+            W = float(double(Bx) * double(Ay) - double(By) * double(Ax));
+        }
+        if ((U < 0.f || V < 0.f || W < 0.f) && (U > 0.f || V > 0.f || W > 0.f)) return false;
+        const float det = U + V + W;
+        if (det == 0.f) return false;
+
+        const float Az = sz * A[kz], Bz = sz * B[kz], Cz = sz * C[kz];
+        const float T = U * Az + V * Bz + W * Cz;
+        // Compare T against det * t range without dividing, with the sign of det folded in
+        const float sign = det < 0.f ? -1.f : 1.f;
+        if (T * sign <= 0.f || T * sign >= t_max * det * sign) return false;
+
+        const float inv_det = 1.f / det;
+        t = T * inv_det;
+        u = V * inv_det;
+        v = W * inv_det;
+        return true;
+    }
+};
+
+// Indexed triangle mesh with its own BVH over the triangles. Triangle i uses the vertices
+// indices[3 i], indices[3 i + 1] and indices[3 i + 2], counter-clockwise seen from the front.
+struct TriangleMesh {
+    Buffer<Vec3f> vertices;
+    Buffer<uint32_t> indices;
+    // Index into the scene's material table
+    uint32_t material = 0;
+    BVH bvh;
+
+    size_t triangle_count() const { return indices.size() / 3; }
+
+    // Has to be called again whenever the vertices or indices change
+    void build_bvh();
+
+    // Closest hit in (0, t_max). Shrinks t_max and returns the triangle and the barycentrics
+    // of its second and third vertex.
+    bool intersect(const Vec3f& ro, const Vec3f& rd, float& t_max, uint32_t& triangle, float& u, float& v) const {
+        const WatertightRay ray(ro, rd);
+        bool hit = false;
+        bvh.traverse(ro, rd, t_max, [&](uint32_t first, uint32_t count, float& t_closest) {
+            for (uint32_t k = first; k < first + count; k++) {
+                const uint32_t tri = bvh.prim_indices[k];
+                float t, bu, bv;
+                if (ray.intersect(vertices[indices[3 * tri]], vertices[indices[3 * tri + 1]], vertices[indices[3 * tri + 2]], t_closest, t, bu, bv)) {
+                    t_closest = t;
+                    triangle = tri;
+                    u = bu;
+                    v = bv;
+                    hit = true;
+                }
+            }
+        });
+        return hit;
+    }
+
+    bool occluded(const Vec3f& ro, const Vec3f& rd, float max_dist) const {
+        const WatertightRay ray(ro, rd);
+        return bvh.occluded(ro, rd, max_dist, [&](uint32_t first, uint32_t count) {
+            for (uint32_t k = first; k < first + count; k++) {
+                const uint32_t tri = bvh.prim_indices[k];
+                float t, u, v;
+                if (ray.intersect(vertices[indices[3 * tri]], vertices[indices[3 * tri + 1]], vertices[indices[3 * tri + 2]], max_dist, t, u, v))
+                    return true;
+            }
+            return false;
+        });
+    }
+
+    // Unit geometric normal on the front side of the triangle
+    Vec3f normal(uint32_t triangle) const {
+        const Vec3f& a = vertices[indices[3 * triangle]];
+        return cross(vertices[indices[3 * triangle + 1]] - a, vertices[indices[3 * triangle + 2]] - a).normalize();
+    }
+};
+
+// Streams a Wavefront OBJ file line by line. Only positions and faces are read, polygons are split into
+// triangle fans and negative (relative) indices are supported. Prints an error and returns false on failure.
+bool load_obj(const char* path, TriangleMesh& mesh);
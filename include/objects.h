@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include "geometry.h"
 
 struct Material {
@@ -11,7 +12,7 @@ struct Material {
     Material(const Vec3f& color)
         : color(color), diffuse(0.6f), specular(0.5f), ambient(0.1f), shininess(50.f), reflectivity(0.5f), refractivity(0.5f), ior(1.0f) {}
     Material() 
-        : color(Vec3f(1.0f, 1.0f, 1.0f)), diffuse(0.9f), specular(0.1f), shininess(10.f), reflectivity(0.f), refractivity(0.f), ior(1.f) {}
+        : color(Vec3f(1.0f, 1.0f, 1.0f)), diffuse(0.9f), specular(0.1f), shininess(10.f), ambient(0.1f), reflectivity(0.f), refractivity(0.f), ior(1.f) {}
     Vec3f color;
     float diffuse;
     float specular;
@@ -25,9 +26,10 @@ struct Material {
 struct Sphere {
     Vec3f center;
     float radius;
-    Material material;
+    // Index into the scene's material table
+    uint32_t material;
 
-    Sphere(const Vec3f& c, const float& r, const Material& material) : center(c), radius(r), material(material) {}
+    Sphere(const Vec3f& c, const float& r, uint32_t material) : center(c), radius(r), material(material) {}
 
     bool ray_intersect(const Vec3f& orig, const Vec3f& dir, float& t0) const {
         Vec3f L = center - orig;
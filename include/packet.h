@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include "bvh.h"
+#include "geometry.h"
+
+// Up to 64 coherent rays sharing their origin, typically the camera rays of an 8x8 pixel block. The rays lie
+// inside the frustum of four planes through the origin, so the whole packet skips boxes outside one of them.
+struct RayPacket {
+    static const int MAX_SIZE = 64;
+
+    Vec3f ro;
+    int size = 0;
+    Vec3f rd[MAX_SIZE], inv_rd[MAX_SIZE];
+    // Inward normals of the side planes and the direction the children of inner nodes are ordered along
+    Vec3f planes[4];
+    Vec3f center_rd;
+
+    void push_back(const Vec3f& dir) {
+        rd[size] = dir;
+        inv_rd[size] = Vec3f(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+        size++;
+    }
+
+    // corners are four directions going around the packet. Every ray has to lie inside the pyramid they span,
+    // so pass directions a little outside the outermost rays rather than those rays themselves.
+    void set_frustum(const Vec3f corners[4]) {
+        center_rd = corners[0] + corners[1] + corners[2] + corners[3];
+        for (int k = 0; k < 4; k++) {
+            planes[k] = cross(corners[k], corners[(k + 1) % 4]);
+            if (planes[k] * center_rd < 0) planes[k] = -planes[k];
+        }
+    }
+
+    // Whether the box lies entirely outside the frustum. Conservative, boxes near a corner may pass.
+    bool outside(const AABB& box) const {
+        for (const Vec3f& n : planes) {
+            const Vec3f farthest(n.x >= 0 ? box.max.x : box.min.x, n.y >= 0 ? box.max.y : box.min.y, n.z >= 0 ? box.max.z : box.min.z);
+            if ((farthest - ro) * n < 0) return true;
+        }
+        return false;
+    }
+};
+
+// Packet counterpart of BVH::traverse. Nodes outside the frustum are skipped at once, the others are entered
+// as long as one ray hits their box before its own t_max. Every node remembers the first ray that hit its parent,
+// rays before it missed the parent and so miss the node as well. leaf(first, count, ray, t_max[ray]) is called for
+// every ray that hits a leaf's box and shrinks that ray's t_max like the single ray leaf function.
+template <typename LeafFn>
+void traverse_packet(const BVH& bvh, const RayPacket& packet, float* t_max, LeafFn leaf) {
+    if (bvh.nodes.empty() || packet.size == 0) return;
+    struct Entry { uint32_t node; int first_ray; };
+    Entry stack[BVH::MAX_DEPTH];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, 0 };
+
+    while (stack_size > 0) {
+        const Entry entry = stack[--stack_size];
+        RT_COUNT(node_visits, 1);
+        const BVHNode& node = bvh.nodes[entry.node];
+        if (packet.outside(node.bounds)) continue;
+        int first_ray = entry.first_ray;
+        float t_entry;
+        while (first_ray < packet.size && !node.bounds.ray_intersect(packet.ro, packet.inv_rd[first_ray], t_max[first_ray], t_entry)) first_ray++;
+        if (first_ray == packet.size) continue;
+
+        if (node.is_leaf()) {
+            leaf(node.left_first, node.count, first_ray, t_max[first_ray]);
+            for (int r = first_ray + 1; r < packet.size; r++) {
+                if (node.bounds.ray_intersect(packet.ro, packet.inv_rd[r], t_max[r], t_entry)) leaf(node.left_first, node.count, r, t_max[r]);
+            }
+            continue;
+        }
+        // Rays of a packet point the same way, so one order of the children is front to back for all of them
+        uint32_t near_child = node.left_first, far_child = node.left_first + 1;
+        if ((bvh.nodes[far_child].bounds.centroid() - bvh.nodes[near_child].bounds.centroid()) * packet.center_rd < 0) {
+            std::swap(near_child, far_child);
+        }
+        stack[stack_size++] = { far_child, first_ray };
+        stack[stack_size++] = { near_child, first_ray };
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+#include "renderer.h"
+
+// Step of the first progressive pass, which renders every PROGRESSIVE_FIRST_STEP-th pixel in both directions.
+// Every further pass halves the step, the last one fills in all remaining pixels.
+const int PROGRESSIVE_FIRST_STEP = 8;
+
+// Receives a preview of the image on the preview thread. finished_passes counts the passes completed before
+// the preview was taken, pixels of later passes may already show.
+typedef std::function<void(const std::vector<Vec3uc>& preview, int finished_passes)> PreviewFn;
+
+// Renders the same image as render(), in passes of growing resolution into a float buffer. While the workers
+// render, a background thread takes a preview after every pass and at least every interval_ms and hands it to
+// preview. Pixels that are not rendered yet repeat the closest rendered pixel above and to the left of them.
+// The workers never wait for the previews, a slow preview just makes the thread skip ahead.
+std::vector<Vec3uc> render_progressive(const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options,
+    int interval_ms, const PreviewFn& preview);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "renderer.h"
+#include "scheduler.h"
+
+struct RelightStats {
+    int changed_lights = 0;
+    uint64_t shadow_rays = 0;
+};
+
+// Relighting from a cache of every shading point of a frame. Light placement has no influence on where camera,
+// reflection and refraction rays go, so the trace trees are traced once and each point keeps the unscaled
+// diffuse and specular factor of every light. Moving a light re-traces one shadow ray per point for that light
+// only, changing just its intensity costs no rays at all. The images are the same as render() would produce.
+class RelightCache {
+public:
+    // Traces the trace trees of every pixel and returns them lit with lights
+    std::vector<Vec3uc> build(const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options);
+    // Brings the cached factors up to date with lights and returns the image. The scene and the options
+    // have to be the ones the cache was built with.
+    std::vector<Vec3uc> relight(const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options, RelightStats* stats = nullptr);
+
+    size_t point_count() const;
+
+private:
+    struct CachedTile {
+        Tile tile;
+        // Trace tree nodes of the tile's pixels, row major. Pixel k owns points [pixel_end[k - 1], pixel_end[k]).
+        std::vector<ShadingPoint> points;
+        std::vector<uint32_t> pixel_end;
+        // Diffuse and specular factor of point p and light l at 2 (p lights + l)
+        std::vector<float> factors;
+    };
+
+    std::vector<CachedTile> tiles;
+    std::vector<Light> cached_lights;
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "hash.h"
+#include "mapped_file.h"
+#include "renderer.h"
+
+// Everything a scene file holds except the BVHs: materials, spheres and meshes. Scenes loaded with map_scene
+// are hashed by the digest write_scene stored in their file, so their contents are not read again.
+Digest hash_geometry(const Scene& scene);
+// Everything the image depends on: the geometry, the lights, the options that change pixels and the envmap,
+// identified by the size and modification time of its source file. Threads, tiles, packets, the integrator and
+// the SIMD kernels are left out, they all render the same image.
+Digest hash_render(const Digest& geometry, const std::vector<Light>& lights, const RenderOptions& options, const FileStamp& envmap_source);
+// The frame hash_render describes, encoded as a JPEG of quality. Stored images are looked up under this key.
+Digest hash_jpeg(const Digest& frame, int quality);
+
+struct RenderCacheStats {
+    int image_hits = 0, image_misses = 0;
+    int scene_hits = 0, scene_misses = 0;
+    int evictions = 0;
+};
+
+// Content addressed cache of encoded frames and built scenes in a directory. An index file records the size
+// and last use of every entry, and the least recently used entries are deleted once they add up to more than the
+// size limit. Entries are written next to their final name and renamed into place. Processes sharing a directory
+// do not lock it, the last one to write the index wins and the other's entries are dropped from it. Hits only
+// update the index in memory, it is written when entries are added, on flush and on destruction. All members
+// may be called from several threads, like the encoder threads storing the frames they encoded.
+class RenderCache {
+public:
+    ~RenderCache() { flush(); }
+    // Creates the directory if needed. Prints an error and returns false if it can not be used.
+    bool open(const std::string& directory, uint64_t max_bytes);
+
+    // The JPEG stored for key, ready to be written out as it is. False on a miss.
+    bool load_jpeg(const Digest& key, std::vector<unsigned char>& jpeg);
+    void store_jpeg(const Digest& key, const std::vector<unsigned char>& jpeg);
+    // Maps the scene file stored for key with map_scene, false on a miss
+    bool load_scene(const Digest& key, Scene& scene);
+    // The scene's BVHs have to be built
+    void store_scene(const Digest& key, const Scene& scene);
+
+    // Writes the index if hits changed it since it was last written
+    void flush();
+
+    RenderCacheStats stats();
+    uint64_t size();
+
+private:
+    struct Entry {
+        std::string name;
+        uint64_t bytes;
+        uint64_t last_use;
+    };
+    std::string path(const std::string& name) const { return directory + "/" + name; }
+    uint64_t total_bytes() const;
+    Entry* find(const std::string& name);
+    // Adds a file that was just written, then evicts and saves the index
+    void add(const std::string& name);
+    void touch(Entry& entry);
+    void evict(const std::string& keep);
+    void save_index();
+
+    std::string directory;
+    uint64_t max_bytes = 0;
+    uint64_t clock = 0;
+    std::vector<Entry> entries;
+    // Set when the last use of an entry changed after the index was written
+    bool dirty = false;
+    RenderCacheStats counts;
+    std::mutex mutex;
+};
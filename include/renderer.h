@@ -0,0 +1,132 @@
+#pragma once
+
+#include <vector>
+#include "counters.h"
+#include "envmap.h"
+#include "geometry.h"
+#include "objects.h"
+#include "packet.h"
+#include "scene.h"
+
+enum class Integrator {
+    // Follows the reflection/refraction tree of one pixel after the other
+    DepthFirst,
+    // Traces all rays of a tile bounce by bounce, see trace_wavefront in renderer.cpp
+    Wavefront
+};
+
+struct RenderOptions {
+    int width = 1024;
+    int height = 768;
+    int threads = 1;
+    int tile_size = 16;
+    // Secondary rays whose contribution to the pixel would be scaled by at most this are not traced.
+    // 0 only prunes rays that cannot contribute at all.
+    float min_weight = 1e-3f;
+    // Rays at a deeper level of the trace tree just return the environment
+    int max_depth = 4;
+    // Camera rays of the depth first integrator are traced in packets of PACKET_DIM x PACKET_DIM pixels,
+    // false traces every one on its own
+    bool packets = true;
+    Integrator integrator = Integrator::DepthFirst;
+    // Most samples per pixel, a power of 4. 1 traces the pixel center. More jitter the samples in a grid of
+    // strata and trace them 4 at a time, until the standard error of the pixel's mean is at most sample_error
+    // in every channel. Only works with the depth first integrator.
+    int samples = 1;
+    float sample_error = 0.01f;
+    // The camera always looks down -z
+    Vec3f camera_origin = Vec3f(0, 0, 0);
+    // Vertical field of view in degrees
+    float fov = 60.f;
+};
+
+// Filled in by render() when asked for
+struct RenderStats {
+    uint64_t pixels = 0;
+    uint64_t samples = 0;
+    // Pixels that stopped after their first 4 samples and pixels that took all of options.samples
+    uint64_t converged_early = 0;
+    uint64_t hit_limit = 0;
+    // What every pixel cost, row major. Only filled in builds with RAYTRACER_COUNTERS. Rays traced together in a
+    // packet or a wavefront tile share their cost evenly, --primary single charges every pixel exactly.
+    std::vector<RayCounters> pixel_counters;
+};
+
+const int PACKET_DIM = 8;
+
+// Adaptive supersampling traces the samples of a pixel this many at a time
+const int SAMPLE_BATCH = 4;
+
+// Deepest max_depth the fixed size ray stack of cast_ray() can hold
+const int MAX_TRACE_DEPTH = 62;
+
+// Environment seen by every ray that escapes the scene
+extern Envmap envmap;
+
+Vec3f reflect(const Vec3f& I, const Vec3f& N);
+Vec3f refract(const Vec3f& I, const Vec3f& N, const float& ior);
+void fresnel(const Vec3f& I, const Vec3f& N, const float& ior, float& kr);
+Vec3f sample_envmap(const Vec3f& ro, const Vec3f& rd);
+
+// What scene_intersect finds along a ray. Traversal fills in only what it computes anyway, the normal and the
+// material are derived on demand with hit_normal and hit_material.
+struct HitRecord {
+    static const int32_t SPHERE = -1;
+    static const int32_t PLANE = -2;
+
+    float t;
+    // Slot in scene.sphere_soa or triangle of the mesh, 0 for the plane
+    uint32_t prim;
+    // Index into scene.meshes, or SPHERE or PLANE
+    int32_t mesh;
+    // Barycentrics of the triangle's second and third vertex, x and z of the hit on the plane
+    float u, v;
+};
+
+bool scene_intersect(const Vec3f& ro, const Vec3f& rd, const Scene& scene, HitRecord& hit);
+// Index into scene.materials
+uint32_t hit_material(const Scene& scene, const HitRecord& hit);
+// Unit normal for shading the hit of the ray ro, rd
+Vec3f hit_normal(const Vec3f& ro, const Vec3f& rd, const Scene& scene, const HitRecord& hit);
+bool scene_occluded(const Vec3f& ro, const Vec3f& rd, const Scene& scene, float max_dist);
+Vec3f cast_ray(const Vec3f& ro, const Vec3f& rd, const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options);
+// cast_ray for every ray of the packet, colors gets one entry per ray
+void cast_packet(const RayPacket& packet, const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options, Vec3f* colors);
+
+// One node of a pixel's trace tree with what its direct lighting needs. Rendering a pixel adds up the nodes in
+// the order trace_shading_points records them, so they can be relit without tracing the tree again.
+struct ShadingPoint {
+    // material of rays that left the scene, their weighted environment color is stored in position
+    static const uint32_t ENVIRONMENT = 0xffffffffu;
+
+    Vec3f position, normal;
+    // Direction of the ray that hit the point
+    Vec3f rd;
+    float weight;
+    // Index into scene.materials or ENVIRONMENT
+    uint32_t material;
+};
+
+// Appends the nodes of the trace tree of the ray ro, rd to points
+void trace_shading_points(const Vec3f& ro, const Vec3f& rd, const Scene& scene, const RenderOptions& options, std::vector<ShadingPoint>& points);
+// Diffuse and specular factors of a light at a point, before scaling by its intensity. Both are 0 in shadow.
+void light_factors(const ShadingPoint& point, const Light& light, const Scene& scene, float& diffuse, float& specular);
+// Color a point adds to its pixel, given its diffuse and specular light intensities summed over the lights
+Vec3f shade_point(const ShadingPoint& point, const Scene& scene, float diffuse_light_intensity, float specular_light_intensity);
+
+// Pinhole camera at options.camera_origin looking down -z with a vertical field of view of options.fov
+struct Camera {
+    explicit Camera(const RenderOptions& options);
+    // Direction through the point (x, y) of the image plane in pixels, pixel centers are at + 0.5
+    Vec3f direction(float x, float y) const;
+
+    Vec3f origin;
+    int width, height;
+    float aspect, screen_width;
+};
+
+// Clamps a linear color to [0, 1] and quantizes it for the framebuffer
+Vec3uc to_pixel(const Vec3f& color);
+
+// Renders the scene seen through Camera(options) into an options.width x options.height RGB framebuffer
+std::vector<Vec3uc> render(const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options, RenderStats* stats = nullptr);
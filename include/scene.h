@@ -0,0 +1,59 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "buffer.h"
+#include "bvh.h"
+#include "hash.h"
+#include "mapped_file.h"
+#include "mesh.h"
+#include "objects.h"
+#include "sphere_soa.h"
+
+// Every material table starts with the materials of the checkerboard plane's odd and even squares
+const uint32_t CHECKER_ODD_MATERIAL = 0;
+const uint32_t CHECKER_EVEN_MATERIAL = 1;
+
+struct Scene {
+    Scene();
+
+    // Shared by all primitives, which refer to their material by index
+    Buffer<Material> materials;
+    // Authoring input of build_bvh, rendering only reads the arrays derived from it below
+    std::vector<Sphere> spheres;
+    BVH bvh;
+    // Sphere geometry in BVH leaf order, leaf ranges index it directly and bvh.prim_indices maps back to spheres
+    SphereSoA sphere_soa;
+    // Material index of every sphere in sphere_soa order
+    Buffer<uint32_t> sphere_material;
+    // Every mesh brings its own BVH, rays test the meshes one after the other
+    std::vector<TriangleMesh> meshes;
+    // Set for scenes loaded with map_scene, the buffers above view into this file
+    std::shared_ptr<const MappedFile> mapping;
+    // Digest of the file's contents, stored in it by write_scene. Only set with mapping.
+    Digest file_digest;
+
+    size_t sphere_count() const { return sphere_material.size(); }
+
+    uint32_t add_material(const Material& material) {
+        materials.push_back(material);
+        return uint32_t(materials.size() - 1);
+    }
+
+    // Has to be called again whenever spheres or meshes change
+    void build_bvh();
+    // Only the sphere part of build_bvh, the meshes keep their BVHs
+    void build_sphere_bvh();
+    // Cheaper alternative to build_sphere_bvh when only sphere centers changed. Copies the centers into
+    // sphere_soa and refits the BVH to them, returns its SAH cost afterwards.
+    float refit_sphere_bvh();
+    // Fills spheres back in from the arrays above, scenes loaded with map_scene come without them
+    void unpack_spheres();
+};
+
+// The four spheres and three lights of the example images. The BVH is not built yet.
+Scene make_demo_scene();
+std::vector<Light> make_demo_lights();
+// count spheres with the demo materials scattered through the view frustum, their size shrinks with the count
+// to keep the density even. The BVH is not built yet.
+Scene make_random_scene(int count, unsigned seed);
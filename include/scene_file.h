@@ -0,0 +1,16 @@
+#pragma once
+
+#include "scene.h"
+
+// Binary scene files hold everything rendering reads, laid out exactly as it sits in memory: the material table,
+// the padded sphere SoA arrays with their material indices, the sphere BVH and every mesh with its BVH. Sections
+// start on 64 byte boundaries, so a mapped file is rendered in place without parsing or copying.
+
+// Writes a scene whose BVHs are built. Prints an error and returns false on failure.
+bool write_scene(const char* path, const Scene& scene);
+
+// Maps a scene file written by write_scene. The scene's buffers view into the mapping, which the scene keeps
+// alive. Its spheres vector stays empty, so build_bvh must not be called on it. Besides the layout, one pass
+// checks that the BVH nodes form a tree and every node, vertex, sphere and material index is in range. Other
+// contents are trusted. Prints an error and returns false on failure.
+bool map_scene(const char* path, Scene& scene);
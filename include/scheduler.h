@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "trace.h"
+
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+// Splits a width x height framebuffer into tiles of at most tile_size x tile_size pixels, row major.
+inline std::vector<Tile> make_tiles(int width, int height, int tile_size) {
+    std::vector<Tile> tiles;
+    for (int y = 0; y < height; y += tile_size) {
+        for (int x = 0; x < width; x += tile_size) {
+            tiles.push_back({ x, y, std::min(x + tile_size, width), std::min(y + tile_size, height) });
+        }
+    }
+    return tiles;
+}
+
+// Double ended queue of tile indices. The owning worker pops from the back,
+// thieves take from the front so they grab the work that is furthest away from the owner.
+class WorkDeque {
+public:
+    void push(int item) {
+        std::lock_guard<std::mutex> lock(mutex);
+        items.push_back(item);
+    }
+    bool pop(int& item) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.empty()) return false;
+        item = items.back();
+        items.pop_back();
+        return true;
+    }
+    bool steal(int& item) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.empty()) return false;
+        item = items.front();
+        items.pop_front();
+        return true;
+    }
+private:
+    std::mutex mutex;
+    std::deque<int> items;
+};
+
+// Threads started on the first parallel call and kept for the rest of the process, so frames of a sequence,
+// progressive passes and server jobs do not start and join threads of their own. Grows when a call asks for more
+// threads than it has, never shrinks.
+class WorkerPool {
+public:
+    static WorkerPool& instance();
+    ~WorkerPool();
+
+    // Runs job(t) for t in [0, threads), job(0) on the calling thread. Returns once every call has returned.
+    // Only one run at a time uses the pool, a concurrent run or one nested in a job, on
+    // any thread, gets false back and nothing is run.
+    bool run(int threads, const std::function<void(int)>& job);
+
+private:
+    WorkerPool() {}
+    void worker(int id);
+
+    std::vector<std::thread> workers;
+    // Set for the duration of a run
+    std::atomic<bool> busy{ false };
+    std::mutex mutex;
+    std::condition_variable wake, finished;
+    const std::function<void(int)>* current = nullptr;
+    int active = 0;
+    int pending = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+};
+
+// Runs work(worker, item) for every item in [0, count) on num_threads workers of the WorkerPool.
+// Items are dealt out in contiguous blocks, idle workers steal from the others.
+// With num_threads <= 1 everything runs on the calling thread, which is always worker 0. So does a call made while
+// the pool is busy, from another thread or from inside work.
+inline void parallel_for_stealing(int count, int num_threads, const std::function<void(int, int)>& work) {
+    if (num_threads <= 1 || count <= 1) {
+        for (int i = 0; i < count; i++) work(0, i);
+        return;
+    }
+    num_threads = std::min(num_threads, count);
+
+    std::vector<WorkDeque> deques(num_threads);
+    for (int t = 0; t < num_threads; t++) {
+        int begin = count * t / num_threads;
+        int end = count * (t + 1) / num_threads;
+        // Pushed in reverse so the owner walks its block in order
+        for (int i = end - 1; i >= begin; i--) deques[t].push(i);
+    }
+    // Tiles are never re-queued, so once every deque is empty a worker can retire
+    auto worker = [&](int id) {
+        int item;
+        for (;;) {
+            bool found = deques[id].pop(item);
+            for (int k = 1; !found && k < num_threads; k++) {
+                found = deques[(id + k) % num_threads].steal(item);
+            }
+            if (!found) return;
+            work(id, item);
+        }
+    };
+
+    if (!WorkerPool::instance().run(num_threads, worker)) {
+        for (int i = 0; i < count; i++) work(0, i);
+    }
+}
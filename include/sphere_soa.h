@@ -0,0 +1,272 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "buffer.h"
+#include "geometry.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RT_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define RT_TARGET_AVX2
+#else
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Sphere geometry as structure of arrays, so one ray can be tested against several spheres per instruction.
+// Only the geometry lives here, callers map an entry back to its sphere (and material) on their own.
+// The arrays are padded with PADDING dummy spheres so kernels may always load full vectors.
+struct SphereSoA {
+    static const int PADDING = 8;
+
+    Buffer<float> center_x, center_y, center_z, radius;
+
+    void clear() {
+        center_x.clear();
+        center_y.clear();
+        center_z.clear();
+        radius.clear();
+    }
+    void push_back(const Vec3f& center, float r) {
+        center_x.push_back(center.x);
+        center_y.push_back(center.y);
+        center_z.push_back(center.z);
+        radius.push_back(r);
+    }
+    void pad() {
+        for (int i = 0; i < PADDING; i++) push_back(Vec3f(0, 0, 0), 0);
+    }
+    size_t size() const { return center_x.size() - PADDING; }
+};
+
+// Closest hit of the ray against spheres [first, first + count). Returns the index of the closest sphere,
+// the lowest one on ties, or -1 and writes its distance to t. Same arithmetic as Sphere::ray_intersect.
+typedef int (*SphereClosestFn)(const SphereSoA& s, uint32_t first, uint32_t count, const Vec3f& ro, const Vec3f& rd, float& t);
+// Whether any of the spheres [first, first + count) is hit before max_dist
+typedef bool (*SphereOccludedFn)(const SphereSoA& s, uint32_t first, uint32_t count, const Vec3f& ro, const Vec3f& rd, float max_dist);
+
+inline bool sphere_hit_scalar(const SphereSoA& s, uint32_t i, const Vec3f& ro, const Vec3f& rd, float& t0) {
+    Vec3f L = Vec3f(s.center_x[i], s.center_y[i], s.center_z[i]) - ro;
+    float tca = L * rd;
+    float d2 = L * L - tca * tca;
+    float r2 = s.radius[i] * s.radius[i];
+    if (d2 > r2) return false;
+    float thc = sqrtf(r2 - d2);
+    t0 = tca - thc;
+    float t1 = tca + thc;
+    if (t0 < 0) t0 = t1;
+    return t0 >= 0;
+}
+
+inline int sphere_closest_scalar(const SphereSoA& s, uint32_t first, uint32_t count, const Vec3f& ro, const Vec3f& rd, float& t) {
+    int best = -1;
+    t = std::numeric_limits<float>::max();
+    for (uint32_t i = first; i < first + count; i++) {
+        float ti;
+        if (sphere_hit_scalar(s, i, ro, rd, ti) && ti < t) {
+            t = ti;
+            best = i;
+        }
+    }
+    return best;
+}
+
+inline bool sphere_occluded_scalar(const SphereSoA& s, uint32_t first, uint32_t count, const Vec3f& ro, const Vec3f& rd, float max_dist) {
+    for (uint32_t i = first; i < first + count; i++) {
+        float ti;
+        if (sphere_hit_scalar(s, i, ro, rd, ti) && ti < max_dist) return true;
+    }
+    return false;
+}
+
+#ifdef RT_X86
+
+// Distances of 4 spheres starting at i, lanes that miss are +inf
+inline __m128 sphere_hit_sse(const SphereSoA& s, uint32_t i, __m128 ox, __m128 oy, __m128 oz, __m128 dx, __m128 dy, __m128 dz) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    __m128 lx = _mm_sub_ps(_mm_loadu_ps(&s.center_x[i]), ox);
+    __m128 ly = _mm_sub_ps(_mm_loadu_ps(&s.center_y[i]), oy);
+    __m128 lz = _mm_sub_ps(_mm_loadu_ps(&s.center_z[i]), oz);
+    __m128 r = _mm_loadu_ps(&s.radius[i]);
+    __m128 tca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, dx), _mm_mul_ps(ly, dy)), _mm_mul_ps(lz, dz));
+    __m128 ll = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz));
+    __m128 d2 = _mm_sub_ps(ll, _mm_mul_ps(tca, tca));
+    __m128 r2 = _mm_mul_ps(r, r);
+    __m128 valid = _mm_cmple_ps(d2, r2);
+    __m128 thc = _mm_sqrt_ps(_mm_sub_ps(r2, d2));
+    __m128 t0 = _mm_sub_ps(tca, thc);
+    __m128 t1 = _mm_add_ps(tca, thc);
+    __m128 use_t1 = _mm_cmplt_ps(t0, zero);
+    t0 = _mm_or_ps(_mm_and_ps(use_t1, t1), _mm_andnot_ps(use_t1, t0));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(t0, zero));
+    return _mm_or_ps(_mm_and_ps(valid, t0), _mm_andnot_ps(valid, inf));
+}
+
+inline __m128 lane_mask_sse(uint32_t remaining) {
+    const __m128i lanes = _mm_set_epi32(3, 2, 1, 0);
+    return _mm_castsi128_ps(_mm_cmplt_epi32(lanes, _mm_set1_epi32((int)remaining)));
+}
+
+inline int sphere_closest_sse(const SphereSoA& s, uint32_t first, uint32_t count, const Vec3f& ro, const Vec3f& rd, float& t) {
+    const __m128 ox = _mm_set1_ps(ro.x), oy = _mm_set1_ps(ro.y), oz = _mm_set1_ps(ro.z);
+    const __m128 dx = _mm_set1_ps(rd.x), dy = _mm_set1_ps(rd.y), dz = _mm_set1_ps(rd.z);
+    const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    int best = -1;
+    t = std::numeric_limits<float>::max();
+    for (uint32_t i = first; i < first + count; i += 4) {
+        __m128 ti = sphere_hit_sse(s, i, ox, oy, oz, dx, dy, dz);
+        __m128 mask = lane_mask_sse(first + count - i);
+        ti = _mm_or_ps(_mm_and_ps(mask, ti), _mm_andnot_ps(mask, inf));
+        __m128 m = _mm_min_ps(ti, _mm_shuffle_ps(ti, ti, _MM_SHUFFLE(2, 3, 0, 1)));
+        m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+        float tmin = _mm_cvtss_f32(m);
+        if (tmin < t) {
+            int lanes = _mm_movemask_ps(_mm_cmpeq_ps(ti, m));
+            int lane = 0;
+            while (!(lanes & (1 << lane))) lane++;
+            t = tmin;
+            best = i + lane;
+        }
+    }
+    return best;
+}
+
+inline bool sphere_occluded_sse(const SphereSoA& s, uint32_t first, uint32_t count, const Vec3f& ro, const Vec3f& rd, float max_dist) {
+    const __m128 ox = _mm_set1_ps(ro.x), oy = _mm_set1_ps(ro.y), oz = _mm_set1_ps(ro.z);
+    const __m128 dx = _mm_set1_ps(rd.x), dy = _mm_set1_ps(rd.y), dz = _mm_set1_ps(rd.z);
+    const __m128 max_t = _mm_set1_ps(max_dist);
+    for (uint32_t i = first; i < first + count; i += 4) {
+        __m128 ti = sphere_hit_sse(s, i, ox, oy, oz, dx, dy, dz);
+        __m128 hit = _mm_and_ps(lane_mask_sse(first + count - i), _mm_cmplt_ps(ti, max_t));
+        if (_mm_movemask_ps(hit)) return true;
+    }
+    return false;
+}
+
+// Distances of 8 spheres starting at i, lanes that miss are +inf. No FMA so every lane rounds like the scalar code.
+RT_TARGET_AVX2 inline __m256 sphere_hit_avx2(const SphereSoA& s, uint32_t i, __m256 ox, __m256 oy, __m256 oz, __m256 dx, __m256 dy, __m256 dz) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    __m256 lx = _mm256_sub_ps(_mm256_loadu_ps(&s.center_x[i]), ox);
+    __m256 ly = _mm256_sub_ps(_mm256_loadu_ps(&s.center_y[i]), oy);
+    __m256 lz = _mm256_sub_ps(_mm256_loadu_ps(&s.center_z[i]), oz);
+    __m256 r = _mm256_loadu_ps(&s.radius[i]);
+    __m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, dx), _mm256_mul_ps(ly, dy)), _mm256_mul_ps(lz, dz));
+    __m256 ll = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz));
+    __m256 d2 = _mm256_sub_ps(ll, _mm256_mul_ps(tca, tca));
+    __m256 r2 = _mm256_mul_ps(r, r);
+    __m256 valid = _mm256_cmp_ps(d2, r2, _CMP_LE_OQ);
+    __m256 thc = _mm256_sqrt_ps(_mm256_sub_ps(r2, d2));
+    __m256 t0 = _mm256_sub_ps(tca, thc);
+    __m256 t1 = _mm256_add_ps(tca, thc);
+    t0 = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t0, zero, _CMP_GE_OQ));
+    return _mm256_blendv_ps(inf, t0, valid);
+}
+
+RT_TARGET_AVX2 inline __m256 lane_mask_avx2(uint32_t remaining) {
+    const __m256i lanes = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32((int)remaining), lanes));
+}
+
+RT_TARGET_AVX2 inline int sphere_closest_avx2(const SphereSoA& s, uint32_t first, uint32_t count, const Vec3f& ro, const Vec3f& rd, float& t) {
+    const __m256 ox = _mm256_set1_ps(ro.x), oy = _mm256_set1_ps(ro.y), oz = _mm256_set1_ps(ro.z);
+    const __m256 dx = _mm256_set1_ps(rd.x), dy = _mm256_set1_ps(rd.y), dz = _mm256_set1_ps(rd.z);
+    const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    int best = -1;
+    t = std::numeric_limits<float>::max();
+    for (uint32_t i = first; i < first + count; i += 8) {
+        __m256 ti = _mm256_blendv_ps(inf, sphere_hit_avx2(s, i, ox, oy, oz, dx, dy, dz), lane_mask_avx2(first + count - i));
+        __m256 m = _mm256_min_ps(ti, _mm256_permute2f128_ps(ti, ti, 1));
+        m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+        m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+        float tmin = _mm256_cvtss_f32(m);
+        if (tmin < t) {
+            int lanes = _mm256_movemask_ps(_mm256_cmp_ps(ti, m, _CMP_EQ_OQ));
+            int lane = 0;
+            while (!(lanes & (1 << lane))) lane++;
+            t = tmin;
+            best = i + lane;
+        }
+    }
+    return best;
+}
+
+RT_TARGET_AVX2 inline bool sphere_occluded_avx2(const SphereSoA& s, uint32_t first, uint32_t count, const Vec3f& ro, const Vec3f& rd, float max_dist) {
+    const __m256 ox = _mm256_set1_ps(ro.x), oy = _mm256_set1_ps(ro.y), oz = _mm256_set1_ps(ro.z);
+    const __m256 dx = _mm256_set1_ps(rd.x), dy = _mm256_set1_ps(rd.y), dz = _mm256_set1_ps(rd.z);
+    const __m256 max_t = _mm256_set1_ps(max_dist);
+    for (uint32_t i = first; i < first + count; i += 8) {
+        __m256 ti = sphere_hit_avx2(s, i, ox, oy, oz, dx, dy, dz);
+        __m256 hit = _mm256_and_ps(lane_mask_avx2(first + count - i), _mm256_cmp_ps(ti, max_t, _CMP_LT_OQ));
+        if (_mm256_movemask_ps(hit)) return true;
+    }
+    return false;
+}
+
+inline bool cpu_has_avx2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    // The OS has to save the ymm registers too
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+enum class SimdIsa { Scalar, SSE2, AVX2 };
+
+inline const char* simd_isa_name(SimdIsa isa) {
+    switch (isa) {
+    case SimdIsa::AVX2: return "avx2";
+    case SimdIsa::SSE2: return "sse2";
+    default: return "scalar";
+    }
+}
+
+// Widest instruction set the CPU running us supports
+inline SimdIsa detect_simd_isa() {
+#ifdef RT_X86
+    if (cpu_has_avx2()) return SimdIsa::AVX2;
+    return SimdIsa::SSE2;
+#else
+    return SimdIsa::Scalar;
+#endif
+}
+
+struct SphereKernels {
+    SimdIsa isa;
+    SphereClosestFn closest;
+    SphereOccludedFn occluded;
+};
+
+inline SphereKernels sphere_kernels(SimdIsa isa) {
+#ifdef RT_X86
+    if (isa == SimdIsa::AVX2) return { isa, sphere_closest_avx2, sphere_occluded_avx2 };
+    if (isa == SimdIsa::SSE2) return { isa, sphere_closest_sse, sphere_occluded_sse };
+#endif
+    return { SimdIsa::Scalar, sphere_closest_scalar, sphere_occluded_scalar };
+}
+
+// Kernels picked once at startup, set_sphere_kernels() overrides the choice
+inline SphereKernels& active_sphere_kernels() {
+    static SphereKernels kernels = sphere_kernels(detect_simd_isa());
+    return kernels;
+}
+
+inline void set_sphere_kernels(SimdIsa isa) {
+    active_sphere_kernels() = sphere_kernels(isa);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Timeline of the render phases in the Chrome trace event format, which chrome://tracing and Perfetto open.
+// Nothing is recorded before start_trace, until then a TraceSpan costs one relaxed load.
+
+struct TraceEvent {
+    // String literals, the trace only keeps the pointers
+    const char* name;
+    const char* category;
+    int64_t start_ns, duration_ns;
+    const char* arg_keys[2];
+    int64_t arg_values[2];
+    int arg_count;
+};
+
+extern std::atomic<bool> trace_recording;
+
+void start_trace();
+// Writes every event recorded so far. Call it once the threads that recorded them are done.
+bool write_trace(const char* path);
+// Nanoseconds since start_trace
+int64_t trace_clock();
+// Records a finished event on the calling thread
+void trace_record(const TraceEvent& event);
+// Shows the calling thread as name. Threads given the same name share one track.
+void trace_thread_name(const char* name);
+
+// Records the time from its construction to its destruction as one event
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, const char* category = "render") : recording(trace_recording.load(std::memory_order_relaxed)) {
+        if (!recording) return;
+        event.name = name;
+        event.category = category;
+        event.arg_count = 0;
+        event.start_ns = trace_clock();
+    }
+    ~TraceSpan() {
+        if (!recording) return;
+        event.duration_ns = trace_clock() - event.start_ns;
+        trace_record(event);
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    // Shown with the event, at most two per span
+    void arg(const char* key, int64_t value) {
+        if (!recording || event.arg_count == 2) return;
+        event.arg_keys[event.arg_count] = key;
+        event.arg_values[event.arg_count++] = value;
+    }
+
+private:
+    bool recording;
+    TraceEvent event;
+};
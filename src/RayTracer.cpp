@@ -1,248 +1,437 @@
 #define _CRT_SECURE_NO_WARNINGS
-#define _USE_MATH_DEFINES
 
-#include <limits>
+#include <algorithm>
+#include <chrono>
 #include <cmath>
-#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
 #include <vector>
-#include "geometry.h"
-#include "objects.h"
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "animation.h"
+#include "image_writer.h"
+#include "progressive.h"
+#include "relight.h"
+#include "render_cache.h"
+#include "renderer.h"
+#include "scene_file.h"
 #include "stb_image_write.h"
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-
-const float AMBIENT_INTENSITY = 1.0f;
-int envmap_width, envmap_height;
-std::vector<Vec3f> envmap;
-
-Vec3f cast_ray(const Vec3f& ro, const Vec3f& rd, const std::vector<Sphere>& spheres, const std::vector<Light>& lights, int depth);
-
-float clamp(float n, float lower, float upper) {
-    return std::max(lower, std::min(n, upper));
-}
-
-Vec3f reflect(const Vec3f& I, const Vec3f& N) {
-    return I - N * 2.f * (I * N);
+#include "trace.h"
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [--threads N] [--tile-size N] [--simd scalar|sse2|avx2] [--integrator depth-first|wavefront] [--primary packet|single]"
+        " [--min-weight W] [--max-depth N] [--samples N] [--sample-error E] [--progressive MS] [--encoders N]"
+        " [--sequence FILE] [--rebuild-threshold F]"
+        " [--envmap-lookup exact|cube] [--envmap-cache FILE] [--cache DIR] [--cache-size MB]"
+        " [--relight FILE|-] [--trace FILE] [--scene FILE | --obj FILE...]" << std::endl;
 }
 
-Vec3f refract(const Vec3f& I, const Vec3f& N, const float& ior)
-{
-    float cosi = clamp(I*N, -1, 1);
-    float etai = 1, etat = ior;
-    Vec3f n = N;
-    if (cosi < 0) { cosi = -cosi; }
-    else { std::swap(etai, etat); n = -N; }
-    float eta = etai / etat;
-    //k is used to check if critical angle of refraction, where we only have a reflection
-    float k = 1 - eta * eta * (1 - cosi * cosi);
-    return k < 0 ? Vec3f(0, 0, 0) : I * eta + (eta * cosi - sqrtf(k)) * n;
+// Reads "x y z intensity" for every light from one line, false if it does not hold whole lights
+bool parse_lights(const std::string& line, std::vector<Light>& lights) {
+    std::istringstream in(line);
+    lights.clear();
+    float x, y, z, intensity;
+    while (in >> x >> y >> z >> intensity) lights.push_back(Light(Vec3f(x, y, z), intensity));
+    return in.eof() && !lights.empty();
 }
 
-void fresnel(const Vec3f& I, const Vec3f& N, const float& ior, float& kr)
-{
-    float cosi = clamp(-1, 1, I*N);
-    float etai = 1, etat = ior;
-    if (cosi > 0) { std::swap(etai, etat); }
-    // Compute sini using Snell's law
-    float sint = etai / etat * sqrtf(std::max(0.f, 1 - cosi * cosi));
-    // Total internal reflection
-    if (sint >= 1) {
-        kr = 1;
+int main(int argc, char** argv) {
+    RenderOptions options;
+    EnvmapLookup envmap_lookup = EnvmapLookup::Cube;
+    const char* envmap_cache = nullptr;
+    const char* cache_dir = nullptr;
+    int cache_mb = 1024;
+    const char* scene_path = nullptr;
+    const char* trace_path = nullptr;
+    const char* relight_path = nullptr;
+    int progressive_ms = 0;
+    int encoders = 1;
+    const char* animation_path = nullptr;
+    float rebuild_threshold = 0.3f;
+    std::vector<const char*> obj_paths;
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "--threads") && a + 1 < argc) {
+            options.threads = atoi(argv[++a]);
+            if (options.threads < 1) {
+                std::cerr << "Error: --threads expects a positive number" << std::endl;
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[a], "--integrator") && a + 1 < argc) {
+            const char* integrator = argv[++a];
+            if (!strcmp(integrator, "depth-first")) options.integrator = Integrator::DepthFirst;
+            else if (!strcmp(integrator, "wavefront")) options.integrator = Integrator::Wavefront;
+            else {
+                print_usage(argv[0]);
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[a], "--primary") && a + 1 < argc) {
+            const char* mode = argv[++a];
+            if (!strcmp(mode, "packet")) options.packets = true;
+            else if (!strcmp(mode, "single")) options.packets = false;
+            else {
+                print_usage(argv[0]);
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[a], "--tile-size") && a + 1 < argc) {
+            options.tile_size = atoi(argv[++a]);
+            if (options.tile_size < 1) {
+                std::cerr << "Error: --tile-size expects a positive number" << std::endl;
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[a], "--progressive") && a + 1 < argc) {
+            progressive_ms = atoi(argv[++a]);
+            if (progressive_ms < 1) {
+                std::cerr << "Error: --progressive expects a preview interval in milliseconds" << std::endl;
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[a], "--encoders") && a + 1 < argc) {
+            encoders = atoi(argv[++a]);
+            if (encoders < 1) {
+                std::cerr << "Error: --encoders expects a positive number" << std::endl;
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[a], "--sequence") && a + 1 < argc) {
+            animation_path = argv[++a];
+        }
+        else if (!strcmp(argv[a], "--rebuild-threshold") && a + 1 < argc) {
+            rebuild_threshold = atof(argv[++a]);
+            if (!(rebuild_threshold >= 0.f)) {
+                std::cerr << "Error: --rebuild-threshold expects a number of 0 or more" << std::endl;
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[a], "--samples") && a + 1 < argc) {
+            options.samples = atoi(argv[++a]);
+            if (options.samples < 1 || options.samples > 1024 || (options.samples & (options.samples - 1)) || (options.samples & 0xAAAAAAAA)) {
+                std::cerr << "Error: --samples expects a power of 4 up to 1024" << std::endl;
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[a], "--sample-error") && a + 1 < argc) {
+            options.sample_error = atof(argv[++a]);
+            if (!(options.sample_error >= 0.f)) {
+                std::cerr << "Error: --sample-error expects a number of 0 or more" << std::endl;
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[a], "--min-weight") && a + 1 < argc) {
+            options.min_weight = atof(argv[++a]);
+            if (!std::isfinite(options.min_weight) || options.min_weight < 0.f) {
+                std::cerr << "Error: --min-weight expects a number of 0 or more" << std::endl;
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[a], "--max-depth") && a + 1 < argc) {
+            options.max_depth = atoi(argv[++a]);
+            if (options.max_depth < 0 || options.max_depth > MAX_TRACE_DEPTH) {
+                std::cerr << "Error: --max-depth expects a number between 0 and " << MAX_TRACE_DEPTH << std::endl;
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[a], "--envmap-lookup") && a + 1 < argc) {
+            const char* lookup = argv[++a];
+            if (!strcmp(lookup, "exact")) envmap_lookup = EnvmapLookup::Exact;
+            else if (!strcmp(lookup, "cube")) envmap_lookup = EnvmapLookup::Cube;
+            else {
+                print_usage(argv[0]);
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[a], "--envmap-cache") && a + 1 < argc) {
+            envmap_cache = argv[++a];
+        }
+        else if (!strcmp(argv[a], "--cache") && a + 1 < argc) {
+            cache_dir = argv[++a];
+        }
+        else if (!strcmp(argv[a], "--cache-size") && a + 1 < argc) {
+            cache_mb = atoi(argv[++a]);
+            if (cache_mb < 1) {
+                std::cerr << "Error: --cache-size expects a positive number of megabytes" << std::endl;
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[a], "--relight") && a + 1 < argc) {
+            relight_path = argv[++a];
+        }
+        else if (!strcmp(argv[a], "--trace") && a + 1 < argc) {
+            trace_path = argv[++a];
+        }
+        else if (!strcmp(argv[a], "--scene") && a + 1 < argc) {
+            scene_path = argv[++a];
+        }
+        else if (!strcmp(argv[a], "--obj") && a + 1 < argc) {
+            obj_paths.push_back(argv[++a]);
+        }
+        else if (!strcmp(argv[a], "--simd") && a + 1 < argc) {
+            const char* isa = argv[++a];
+            SimdIsa widest = detect_simd_isa();
+            if (!strcmp(isa, "scalar")) set_sphere_kernels(SimdIsa::Scalar);
+            else if (!strcmp(isa, "sse2") && widest >= SimdIsa::SSE2) set_sphere_kernels(SimdIsa::SSE2);
+            else if (!strcmp(isa, "avx2") && widest >= SimdIsa::AVX2) set_sphere_kernels(SimdIsa::AVX2);
+            else {
+                std::cerr << "Error: instruction set " << isa << " is not available, the widest one is " << simd_isa_name(widest) << std::endl;
+                return -1;
+            }
+        }
+        else {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    if (scene_path && !obj_paths.empty()) {
+        std::cerr << "Error: meshes of a --scene file are added with raytracer_scene --obj" << std::endl;
+        return -1;
+    }
+    if (options.samples > 1 && (progressive_ms || options.integrator == Integrator::Wavefront)) {
+        std::cerr << "Error: --samples works with the depth-first integrator and without --progressive" << std::endl;
+        return -1;
+    }
+    if (relight_path && (animation_path || progressive_ms || options.samples > 1)) {
+        std::cerr << "Error: --relight can not be combined with --sequence, --progressive or --samples" << std::endl;
+        return -1;
+    }
+    if (animation_path && progressive_ms) {
+        std::cerr << "Error: --progressive previews a single frame, it can not be combined with --sequence" << std::endl;
+        return -1;
     }
-    else {
-        float cost = sqrtf(std::max(0.f, 1 - sint * sint));
-        cosi = fabsf(cosi);
-        float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
-        float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
-        kr = (Rs * Rs + Rp * Rp) / 2;
-    }
-    // As a consequence of the conservation of energy, the transmittance is given by:
-    // kt = 1 - kr;
-}
-
-
-
-void render(std::vector<Sphere> spheres, std::vector<Light> lights) {
-    const int width = 1024;
-    const int height = 768;
-    const Vec3f origin = Vec3f(0.0, 0.0, 0.0);
-    const float screen_cam_dist = 1.0f;
-    const float fov = 60.f * M_PI / 180.f; //in radians
-    const float aspect = width / (float)height;
-
-    std::vector<Vec3uc> framebuffer(width * height);
 
-    for (size_t j = 0; j < height; j++) {
-        for (size_t i = 0; i < width; i++) {
-            //https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-generating-camera-rays/generating-camera-rays.html
-            float screen_width = tan(fov / 2.f) * screen_cam_dist;
-            float rx = (2*(i + 0.5f) / (float)width -1) * screen_width * aspect;
-            float ry = (1 - 2*(j + 0.5f) / (float)height) * screen_width;
-            Vec3f rd = Vec3f(rx, ry, -1.f).normalize();
+    if (trace_path) start_trace();
+    RenderCache render_cache;
+    if (cache_dir && !render_cache.open(cache_dir, uint64_t(cache_mb) << 20)) return -1;
 
-            Vec3f color = cast_ray(origin, rd, spheres, lights, 0);
-            framebuffer[i + j * width] = Vec3uc(
-                int(std::min(1.f, color.x) * 255), 
-                int(std::min(1.f, color.y) * 255), 
-                int(std::min(1.f, color.z) * 255));
+    auto envmap_start = std::chrono::steady_clock::now();
+    bool envmap_from_cache = false;
+    if (envmap_cache) {
+        if (!envmap.load_cached("envmap.jpg", envmap_cache, envmap_lookup == EnvmapLookup::Cube, options.threads, envmap_from_cache)) return -1;
+    }
+    else {
+        if (!envmap.load("envmap.jpg")) return -1;
+        if (envmap_lookup == EnvmapLookup::Cube) envmap.build_cube(0, options.threads);
+    }
+    envmap.lookup = envmap_lookup;
+    std::chrono::duration<double, std::milli> envmap_time = std::chrono::steady_clock::now() - envmap_start;
+    std::cout << "Envmap load: " << envmap_time.count() << " ms (" << envmap.width << "x" << envmap.height;
+    if (envmap.cube) std::cout << ", cube faces " << envmap.face_size << "x" << envmap.face_size;
+    if (envmap_from_cache) std::cout << ", mapped from " << envmap_cache;
+    std::cout << ")" << std::endl;
+
+    std::vector<Light> lights = make_demo_lights();
+    // Single frames are looked up by the hash of everything that goes into the image and the JPEG quality. A hit
+    // is copied to output.jpg without building the BVHs, tracing or encoding.
+    const bool cache_frame = cache_dir && !animation_path && !relight_path;
+    Digest geometry, frame_key;
+    std::vector<unsigned char> cached_jpeg;
+    bool frame_from_cache = false, bvh_from_cache = false;
+    auto lookup_frame = [&]() {
+        FileStamp envmap_stamp = {};
+        file_stamp("envmap.jpg", envmap_stamp);
+        frame_key = hash_jpeg(hash_render(geometry, lights, options, envmap_stamp), 100);
+        frame_from_cache = render_cache.load_jpeg(frame_key, cached_jpeg);
+    };
+
+    Scene scene;
+    auto build_start = std::chrono::steady_clock::now();
+    if (scene_path) {
+        if (!map_scene(scene_path, scene)) return -1;
+        if (cache_dir) geometry = hash_geometry(scene);
+        if (cache_frame) lookup_frame();
+    }
+    else {
+        scene = make_demo_scene();
+        const uint32_t mesh_material = scene.add_material(Material(Vec3f(0.4, 0.4, 0.3), 0.6, 0.3, 50., 0.1, 0.0, 1.0));
+        for (const char* path : obj_paths) {
+            auto mesh_start = std::chrono::steady_clock::now();
+            TriangleMesh mesh;
+            if (!load_obj(path, mesh)) return -1;
+            mesh.material = mesh_material;
+            std::chrono::duration<double, std::milli> mesh_time = std::chrono::steady_clock::now() - mesh_start;
+            std::cout << "Mesh load: " << mesh_time.count() << " ms (" << path << ", " << mesh.vertices.size() << " vertices, "
+                << mesh.triangle_count() << " triangles)" << std::endl;
+            scene.meshes.push_back(std::move(mesh));
+        }
+        build_start = std::chrono::steady_clock::now();
+        // The built scene is cached under the hash of its geometry, so runs that only change the camera, lights or
+        // options map it instead of building the BVHs again
+        if (cache_dir) geometry = hash_geometry(scene);
+        if (cache_frame) lookup_frame();
+        if (cache_dir && !frame_from_cache) bvh_from_cache = render_cache.load_scene(geometry, scene);
+        if (!frame_from_cache && !bvh_from_cache) {
+            scene.build_bvh();
+            if (cache_dir) render_cache.store_scene(geometry, scene);
         }
     }
-    stbi_write_jpg("output.jpg", width, height, 3, framebuffer.data(), 100);
-}
-
-Vec3f sample_envmap(const Vec3f& ro, const Vec3f& rd) {
-    // Convert direction vector to spherical coordinates
-    float theta = acos(rd.y);  // Inclination angle, theta = arccos(cos(y_axis * rd.y)) by def of dot product
-    float phi = atan2(rd.z, rd.x);  // Angle from the x axis, counterclockwise
-
-    // Map spherical coordinates to pixel coordinates
-    int u = (phi + M_PI) / (2 * M_PI) * envmap_width;
-    int v = theta / M_PI * envmap_height;
-
-    // Clamp pixel coordinates to valid range
-    u = std::max(0, std::min(u, envmap_width - 1));
-    v = std::max(0, std::min(v, envmap_height - 1));
-
-    return envmap[u + v * envmap_width];
-}
+    std::chrono::duration<double, std::milli> build_time = std::chrono::steady_clock::now() - build_start;
+    size_t triangles = 0, nodes = scene.bvh.nodes.size();
+    for (const TriangleMesh& mesh : scene.meshes) {
+        triangles += mesh.triangle_count();
+        nodes += mesh.bvh.nodes.size();
+    }
+    if (frame_from_cache && !scene_path) {
+        std::cout << "Scene hash: " << build_time.count() << " ms (frame found in the render cache, no BVH built)" << std::endl;
+    }
+    else {
+        std::cout << (scene_path ? "Scene map: " : bvh_from_cache ? "BVH cache hit: " : "BVH build: ") << build_time.count() << " ms (" << scene.sphere_count() << " spheres, "
+            << triangles << " triangles, " << nodes << " nodes)" << std::endl;
+    }
+    std::cout << "Sphere kernels: " << simd_isa_name(active_sphere_kernels().isa) << std::endl;
 
+    Animation animation;
+    if (animation_path) {
+        if (!load_animation(animation_path, scene.sphere_count(), animation)) return -1;
+        if (scene.spheres.empty()) scene.unpack_spheres();
+    }
 
-bool scene_intersect(const Vec3f& ro, const Vec3f& rd, const std::vector<Sphere>& spheres, Material& mat, float& t0, Vec3f& normal) {
-    float intersection = std::numeric_limits<float>::max(), closest_intersection = std::numeric_limits<float>::max();
-    int ind = -1;
-    for (int i = 0; i < spheres.size(); i++) {
-        if (spheres[i].ray_intersect(ro, rd, intersection)) {
-            if (intersection < closest_intersection) {
-                ind = i;
-                closest_intersection = intersection;
+    // Finished frames wait here for an encoder, two per encoder keep them busy while the next frame renders
+    ImageWriter writer(encoders, 2 * encoders);
+    auto render_start = std::chrono::steady_clock::now();
+    size_t frames = 1;
+    RenderStats stats, frame_stats;
+    RelightCache relight_cache;
+    // The encoder thread stores the frame once it is written
+    EncodedFn store_frame;
+    if (cache_frame) {
+        store_frame = [&](bool ok, const std::vector<unsigned char>& jpeg) {
+            if (ok) render_cache.store_jpeg(frame_key, jpeg);
+        };
+    }
+    if (frame_from_cache) {
+        if (!write_file("output.jpg", cached_jpeg.data(), cached_jpeg.size())) return -1;
+    }
+    else if (animation_path) {
+        // Moving spheres only stretch the BVH, it is refitted every frame and rebuilt once its SAH cost grew
+        // by more than the threshold since the last build
+        frames = animation.frame_count;
+        float built_cost = scene.bvh.sah_cost();
+        double setup_ms = 0, max_setup_ms = 0;
+        int rebuilds = 0;
+        for (uint32_t frame = 0; frame < animation.frame_count; frame++) {
+            auto setup_start = std::chrono::steady_clock::now();
+            if (animation.apply(frame, scene) > 0 && scene.refit_sphere_bvh() > built_cost * (1.f + rebuild_threshold)) {
+                scene.build_sphere_bvh();
+                built_cost = scene.bvh.sah_cost();
+                rebuilds++;
             }
+            std::chrono::duration<double, std::milli> setup_time = std::chrono::steady_clock::now() - setup_start;
+            setup_ms += setup_time.count();
+            max_setup_ms = std::max(max_setup_ms, setup_time.count());
+
+            char path[32];
+            snprintf(path, sizeof(path), "output_%04u.jpg", frame);
+            writer.write_jpg(path, options.width, options.height, render(scene, lights, options, &frame_stats), 100);
+            stats.pixels += frame_stats.pixels;
+            stats.samples += frame_stats.samples;
+            stats.converged_early += frame_stats.converged_early;
+            stats.hit_limit += frame_stats.hit_limit;
+            stats.pixel_counters.resize(frame_stats.pixel_counters.size());
+            for (size_t p = 0; p < frame_stats.pixel_counters.size(); p++) stats.pixel_counters[p] += frame_stats.pixel_counters[p];
         }
+        std::cout << "Sequence setup: " << setup_ms << " ms (" << frames << " frames, " << animation.keys.size() + animation.transforms.size() << " keys, max "
+            << max_setup_ms << " ms per frame, " << rebuilds << " BVH rebuilds)" << std::endl;
     }
-
-
-    //Check intersection with plane
-    if (fabs(rd.y) > 1e-3) {
-        float dist = -(ro.y + 4) / rd.y; // the checkerboard plane has equation y = -4
-        Vec3f pt = ro + rd * dist;
-        if (dist > 0 && fabs(pt.x) < 10 && pt.z<-10 && pt.z>-30 && dist < closest_intersection) {
-            t0 = dist;
-            normal = Vec3f(0., 1., 0.);
-            mat.color = (int(.5 * pt.x + 1000) + int(.5 * pt.z)) & 1 ? Vec3f(.3, .3, .3) : Vec3f(.3, .2, .1);
-            return true;
-        }
+    else if (progressive_ms) {
+        // Previews replace output.jpg as a whole, so viewers never load a half written file. They are encoded at a
+        // lower quality, which takes a third of the time.
+        bool first_preview = true;
+        std::vector<Vec3uc> framebuffer = render_progressive(scene, lights, options, progressive_ms, [&](const std::vector<Vec3uc>& preview, int passes) {
+            stbi_write_jpg("output.jpg.tmp", options.width, options.height, 3, preview.data(), 75);
+#ifdef _WIN32
+            remove("output.jpg");
+#endif
+            rename("output.jpg.tmp", "output.jpg");
+            if (first_preview) {
+                std::chrono::duration<double, std::milli> preview_time = std::chrono::steady_clock::now() - render_start;
+                std::cout << "First preview: " << preview_time.count() << " ms (" << passes << " passes finished)" << std::endl;
+                first_preview = false;
+            }
+        });
+        writer.write_jpg("output.jpg", options.width, options.height, std::move(framebuffer), 100, store_frame);
     }
-    if (ind < 0) return false;
-    mat = spheres[ind].material;
-    t0 = closest_intersection;
-    normal = (ro + rd * t0 - spheres[ind].center).normalize();
-
-    return true;
-}
-
-Vec3f cast_ray(const Vec3f& ro, const Vec3f& rd, const std::vector<Sphere>& spheres, const std::vector<Light>& lights, int depth) {
-    Material mat;
-    float t0;
-    Vec3f normal;
-    Vec3f final_color(0., 0., 0.);
-
-    if (depth > 4 || !scene_intersect(ro, rd, spheres, mat, t0, normal)) {
-        return sample_envmap(ro, rd);
+    else if (relight_path) {
+        writer.write_jpg("output.jpg", options.width, options.height, relight_cache.build(scene, lights, options), 100);
     }
-
-
-    Vec3f hit = ro + rd * t0;
-
-    float diffuse_light_intensity = 0.f;
-    float specular_light_intensity = 0.f;
-    
-    //Check for shadows
-    Material mat_sh;
-    float t0_sh;
-    Vec3f normal_sh;
-
-
-    for (Light light : lights) {
-        Vec3f to_light = (light.position - hit).normalize();
-        //Check for shadow for current light
-        Vec3f shadow_orig = hit + normal * 1e-3;
-        float light_distance = (light.position - hit).norm();
-        if (scene_intersect(shadow_orig, to_light, spheres, mat_sh, t0_sh, normal_sh) && (to_light*t0_sh).norm() < light_distance)
-            continue;
-
-        diffuse_light_intensity += light.intensity * std::max(0.f, to_light * normal);
-
-        Vec3f half_way = (to_light -rd).normalize();
-        specular_light_intensity += powf(std::max(0.f, normal * half_way), mat.shininess) * light.intensity;
+    else {
+        std::vector<Vec3uc> framebuffer = render(scene, lights, options, &stats);
+        writer.write_jpg("output.jpg", options.width, options.height, std::move(framebuffer), 100, store_frame);
+    }
+    // Includes waiting for a free slot in the encode queue, see the Encode line
+    std::chrono::duration<double, std::milli> render_time = std::chrono::steady_clock::now() - render_start;
+    if (frame_from_cache) {
+        std::cout << "Render: skipped (render cache hit)" << std::endl;
+    }
+    else {
+        std::cout << "Render: " << render_time.count() << " ms (" << frames * options.width * options.height / (render_time.count() * 1e-3)
+            << " primary rays/s, " << (progressive_ms ? "progressive" : relight_path ? "relight cache" : options.integrator == Integrator::Wavefront ? "wavefront" : options.packets ? "packet primary rays" : "single primary rays")
+            << ")" << std::endl;
+    }
+    if (options.samples > 1 && stats.pixels) {
+        std::cout << "Samples: " << double(stats.samples) / stats.pixels << " per pixel (" << 100. * stats.converged_early / stats.pixels
+            << "% of pixels stopped at " << SAMPLE_BATCH << ", " << 100. * stats.hit_limit / stats.pixels << "% took all " << options.samples << ")" << std::endl;
     }
 
-    Vec3f reflect_dir = reflect(rd, normal).normalize();
-    Vec3f reflect_orig = reflect_dir * normal < 0 ? hit - normal * 1e-3 : hit + normal * 1e-3; // offset the original point to avoid occlusion by the object itself
-    Vec3f reflect_color = cast_ray(reflect_orig, reflect_dir, spheres, lights, depth + 1);
-
-    Vec3f refract_color;
-    if (mat.refractivity > 0.0) {
-        Vec3f refracted = refract(rd, normal, 1.333);
-        if (!(refracted.x == 0.0 && refracted.y == 0.0 && refracted.z == 0.0)) {
-            Vec3f refract_dir = refracted.normalize();
-            // Similar to reflect orig but opposite, since we want to go through the object
-            Vec3f refract_orig = reflect_dir * normal < 0 ? hit + normal * 1e-3 : hit - normal * 1e-3;
-            refract_color = cast_ray(refract_orig, refract_dir, spheres, lights, depth + 1);
+    if (relight_path) {
+        // One light setup per line, every setup relights the cached frame into output_relight_NNNN.jpg
+        std::cout << "Relight cache: " << relight_cache.point_count() << " shading points" << std::endl;
+        std::ifstream file;
+        if (strcmp(relight_path, "-")) {
+            file.open(relight_path);
+            if (!file) {
+                std::cerr << "Error: can not open " << relight_path << std::endl;
+                return -1;
+            }
+        }
+        std::istream& in = file.is_open() ? file : std::cin;
+        std::string line;
+        for (unsigned setup = 0; std::getline(in, line);) {
+            if (line.find_first_not_of(" \t\r") == std::string::npos || line[line.find_first_not_of(" \t")] == '#') continue;
+            if (!parse_lights(line, lights)) {
+                std::cerr << "Error: expected x y z intensity for every light, got " << line << std::endl;
+                continue;
+            }
+            auto relight_start = std::chrono::steady_clock::now();
+            RelightStats relight_stats;
+            std::vector<Vec3uc> framebuffer = relight_cache.relight(scene, lights, options, &relight_stats);
+            std::chrono::duration<double, std::milli> relight_time = std::chrono::steady_clock::now() - relight_start;
+            char path[32];
+            snprintf(path, sizeof(path), "output_relight_%04u.jpg", setup++);
+            writer.write_jpg(path, options.width, options.height, std::move(framebuffer), 100);
+            std::cout << "Relight: " << relight_time.count() << " ms (" << path << ", " << relight_stats.changed_lights << " lights changed, "
+                << relight_stats.shadow_rays << " shadow rays)" << std::endl;
         }
     }
 
+    // Instrumented builds only, summed over all frames of a sequence
+    if (!stats.pixel_counters.empty()) {
+        if (!write_counters("output", options.width, options.height, stats.pixel_counters)) return -1;
+        std::cout << "Counters: output_heatmap.jpg, output_counters.csv, output_counters.json" << std::endl;
+    }
 
-    Vec3f diffuse = mat.color * mat.diffuse * diffuse_light_intensity;
-    Vec3f specular = mat.color * mat.specular * specular_light_intensity;
-    Vec3f ambient = mat.color * mat.ambient * AMBIENT_INTENSITY;
-    float kr = 1.0;
-    if (mat.refractivity > 0. && mat.reflectivity > 0.)
-        fresnel(rd, normal, mat.ior, kr);
-    Vec3f reflected = reflect_color * mat.reflectivity;
-    Vec3f refracted = refract_color * mat.refractivity;
-    
-    final_color = diffuse + specular + reflected*kr + refracted*(1-kr);
-    return final_color;
-}
-
-
-int main() {
+    ImageWriterStats encode = writer.finish();
+    std::cout << "Encode: " << encode.encode_ms << " ms (" << encode.images << " images, max " << encode.max_encode_ms << " ms, "
+        << encoders << " encoder threads, " << encode.wait_ms << " ms waiting for the queue)" << std::endl;
+    if (encode.failed) return -1;
 
-    int n = -1;
-    unsigned char* pixmap = stbi_load("envmap.jpg", &envmap_width, &envmap_height, &n, 0);
-    if (!pixmap || 3 != n) {
-        std::cerr << "Error: can not load the environment map" << std::endl;
-        return -1;
+    if (cache_dir) {
+        RenderCacheStats cache = render_cache.stats();
+        std::cout << "Render cache: " << (cache_frame ? (frame_from_cache ? "hit " : "miss ") + frame_key.hex() : std::string("frames not cached"))
+            << " (" << cache.scene_hits << " scene hits, " << cache.evictions << " evictions, "
+            << render_cache.size() / (1024. * 1024.) << " of " << cache_mb << " MB used)" << std::endl;
     }
-    envmap = std::vector<Vec3f>(envmap_width * envmap_height);
-    for (int j = envmap_height - 1; j >= 0; j--) {
-        for (int i = 0; i < envmap_width; i++) {
-            envmap[i + j * envmap_width] = Vec3f(pixmap[(i + j * envmap_width) * 3 + 0], pixmap[(i + j * envmap_width) * 3 + 1], pixmap[(i + j * envmap_width) * 3 + 2]) * (1 / 255.);
-        }
+    if (trace_path) {
+        if (!write_trace(trace_path)) return -1;
+        std::cout << "Trace: " << trace_path << std::endl;
     }
-    stbi_image_free(pixmap);
-
-    Material      ivory(Vec3f(0.4, 0.4, 0.3), 0.6, 0.3, 50., 0.1, 0.0, 1.0);
-    Material red_rubber(Vec3f(0.3, 0.1, 0.1), 0.9, 0.1, 10., 0.0, 0.0, 1.0);
-    Material     mirror(Vec3f(1.0, 1.0, 1.0), 0.0, 10.0, 1425., 0.8, 0.0, 1.0);
-    Material      glass(Vec3f(0.6, 0.7, 0.8), 0.0, 0.5, 125., 0.1, 0.8, 1.5);
-
-
-    std::vector<Sphere> spheres;
-    spheres.push_back(Sphere(Vec3f(-3, 0, -16), 2, ivory));
-    spheres.push_back(Sphere(Vec3f(-1.0, -1.5, -12), 2, glass));
-    spheres.push_back(Sphere(Vec3f(1.5, -0.5, -18), 3, red_rubber));
-    spheres.push_back(Sphere(Vec3f(7, 5, -18), 4, mirror));
-
-
-
-    std::vector<Light>  lights;
-    lights.push_back(Light(Vec3f(-20, 20, 20), 1.5));
-    lights.push_back(Light(Vec3f(30, 50, -25), 1.8));
-    lights.push_back(Light(Vec3f(30, 20, 30), 1.7));
-    render(spheres, lights);
 
     std::cout << "Done" << std::endl;
     return 0;
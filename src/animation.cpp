@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "animation.h"
+
+RigidTransform RigidTransform::then(const RigidTransform& next) const {
+    RigidTransform combined;
+    for (int r = 0; r < 3; r++) {
+        const Vec3f column_x(rows[0].x, rows[1].x, rows[2].x);
+        const Vec3f column_y(rows[0].y, rows[1].y, rows[2].y);
+        const Vec3f column_z(rows[0].z, rows[1].z, rows[2].z);
+        combined.rows[r] = Vec3f(next.rows[r] * column_x, next.rows[r] * column_y, next.rows[r] * column_z);
+    }
+    combined.translation = next.apply(translation);
+    return combined;
+}
+
+RigidTransform RigidTransform::translate(const Vec3f& offset) {
+    RigidTransform t;
+    t.translation = offset;
+    return t;
+}
+
+RigidTransform RigidTransform::rotate(const Vec3f& axis, float degrees, const Vec3f& pivot) {
+    // Rodrigues' rotation formula, in double so whole turns come out as close to the identity as floats get
+    const double length = std::sqrt(double(axis.x) * axis.x + double(axis.y) * axis.y + double(axis.z) * axis.z);
+    const double x = axis.x / length, y = axis.y / length, z = axis.z / length;
+    const double angle = degrees * M_PI / 180.;
+    const double c = std::cos(angle), s = std::sin(angle), t = 1. - c;
+    RigidTransform r;
+    r.rows[0] = Vec3f(float(t * x * x + c), float(t * x * y - s * z), float(t * x * z + s * y));
+    r.rows[1] = Vec3f(float(t * x * y + s * z), float(t * y * y + c), float(t * y * z - s * x));
+    r.rows[2] = Vec3f(float(t * x * z - s * y), float(t * y * z + s * x), float(t * z * z + c));
+    // Rotating around the pivot: move it to the origin, rotate, move it back
+    r.translation = pivot - Vec3f(r.rows[0] * pivot, r.rows[1] * pivot, r.rows[2] * pivot);
+    return r;
+}
+
+size_t Animation::apply(uint32_t frame, Scene& scene) {
+    if (frame == 0 || rest.size() != scene.spheres.size()) {
+        rest.resize(scene.spheres.size());
+        for (size_t i = 0; i < rest.size(); i++) rest[i] = scene.spheres[i].center;
+        current.assign(groups.size(), RigidTransform());
+        placed.assign(groups.size(), false);
+        touched.assign(rest.size(), UINT32_MAX);
+    }
+    auto first_key = std::lower_bound(keys.begin(), keys.end(), frame, [](const SphereKey& key, uint32_t f) { return key.frame < f; });
+    auto first_transform = std::lower_bound(transforms.begin(), transforms.end(), frame, [](const TransformKey& key, uint32_t f) { return key.frame < f; });
+
+    for (auto key = first_key; key != keys.end() && key->frame == frame; ++key) rest[key->sphere] = key->center;
+    std::vector<bool> changed(groups.size(), false);
+    for (auto key = first_transform; key != transforms.end() && key->frame == frame; ++key) {
+        // The first key of a group in a frame replaces its transform, the others are chained to it
+        if (!changed[key->group]) current[key->group] = RigidTransform();
+        current[key->group] = current[key->group].then(key->transform);
+        changed[key->group] = placed[key->group] = true;
+    }
+
+    size_t moved = 0;
+    auto place = [&](uint32_t sphere) {
+        if (touched[sphere] == frame) return;
+        touched[sphere] = frame;
+        moved++;
+        Vec3f center = rest[sphere];
+        for (size_t g = 0; g < groups.size(); g++) {
+            if (!placed[g]) continue;
+            for (const std::pair<uint32_t, uint32_t>& range : groups[g].ranges) {
+                if (sphere >= range.first && sphere - range.first < range.second) {
+                    center = current[g].apply(center);
+                    break;
+                }
+            }
+        }
+        scene.spheres[sphere].center = center;
+    };
+    for (auto key = first_key; key != keys.end() && key->frame == frame; ++key) place(key->sphere);
+    for (size_t g = 0; g < groups.size(); g++) {
+        if (!changed[g]) continue;
+        for (const std::pair<uint32_t, uint32_t>& range : groups[g].ranges) {
+            for (uint32_t s = range.first; s < range.first + range.second; s++) place(s);
+        }
+    }
+    return moved;
+}
+
+namespace {
+
+// Whole decimal number in [0, INT32_MAX]
+bool parse_index(const std::string& token, long long& value) {
+    char* end;
+    value = strtoll(token.c_str(), &end, 10);
+    return !token.empty() && *end == '\0' && value >= 0 && value <= INT32_MAX;
+}
+
+// True when nothing but whitespace is left
+bool at_end(std::istringstream& in) {
+    in >> std::ws;
+    return in.eof();
+}
+
+}
+
+bool load_animation(const char* path, size_t sphere_count, Animation& animation) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Error: can not open " << path << std::endl;
+        return false;
+    }
+    animation = Animation();
+    animation.groups.push_back({ "all", { { 0u, uint32_t(sphere_count) } } });
+
+    std::string line;
+    size_t line_number = 0;
+    while (std::getline(in, line)) {
+        line_number++;
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#') continue;
+        std::istringstream fields(line);
+        std::string first, second, name;
+        long long frame = 0, index = 0, count = 0;
+        bool ok = bool(fields >> first >> second);
+        if (ok && first == "group") {
+            ok = fields >> index >> count && at_end(fields) && second != "all" && index >= 0 && count > 0
+                && size_t(index) + size_t(count) <= sphere_count;
+            if (ok) {
+                auto group = std::find_if(animation.groups.begin(), animation.groups.end(), [&](const SphereGroup& g) { return g.name == second; });
+                if (group == animation.groups.end()) group = animation.groups.insert(animation.groups.end(), { second, {} });
+                group->ranges.push_back({ uint32_t(index), uint32_t(count) });
+            }
+        }
+        else if (ok && (second == "translate" || second == "rotate")) {
+            Vec3f v, pivot(0, 0, 0);
+            float degrees = 0;
+            ok = parse_index(first, frame) && fields >> name >> v.x >> v.y >> v.z;
+            if (ok && second == "rotate") {
+                ok = bool(fields >> degrees) && (v.x != 0 || v.y != 0 || v.z != 0);
+                if (ok && !at_end(fields)) ok = bool(fields >> pivot.x >> pivot.y >> pivot.z);
+            }
+            auto group = std::find_if(animation.groups.begin(), animation.groups.end(), [&](const SphereGroup& g) { return g.name == name; });
+            ok = ok && at_end(fields) && group != animation.groups.end();
+            if (ok) {
+                RigidTransform transform = second == "rotate" ? RigidTransform::rotate(v, degrees, pivot) : RigidTransform::translate(v);
+                animation.transforms.push_back({ uint32_t(frame), uint32_t(group - animation.groups.begin()), transform });
+            }
+        }
+        else if (ok) {
+            Vec3f center;
+            ok = parse_index(first, frame) && parse_index(second, index) && size_t(index) < sphere_count
+                && fields >> center.x >> center.y >> center.z && at_end(fields);
+            if (ok) animation.keys.push_back({ uint32_t(frame), uint32_t(index), center });
+        }
+        if (!ok) {
+            std::cerr << "Error: malformed key in " << path << " on line " << line_number << std::endl;
+            return false;
+        }
+        if (first != "group") animation.frame_count = std::max(animation.frame_count, uint32_t(frame) + 1);
+    }
+    // Stable, so keys of the same frame keep their file order and of two keys for the same sphere the later line wins
+    std::stable_sort(animation.keys.begin(), animation.keys.end(), [](const SphereKey& a, const SphereKey& b) { return a.frame < b.frame; });
+    std::stable_sort(animation.transforms.begin(), animation.transforms.end(), [](const TransformKey& a, const TransformKey& b) { return a.frame < b.frame; });
+    if (animation.keys.empty() && animation.transforms.empty()) {
+        std::cerr << "Error: " << path << " has no keys" << std::endl;
+        return false;
+    }
+    return true;
+}
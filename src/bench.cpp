@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "renderer.h"
+
+// Micro-benchmarks of the hot kernels and end-to-end frames over scenes of growing size.
+// Everything is reported as one JSON document so release gates can diff runs.
+
+typedef std::chrono::steady_clock Clock;
+
+struct BenchConfig {
+    int threads = 1;
+    int frames = 5;
+    int rays = 1 << 20;
+    int repeats = 5;
+    int max_spheres = 1 << 20;
+    int width = 320;
+    int height = 240;
+    unsigned seed = 1;
+};
+
+struct Ray {
+    Vec3f ro, rd;
+};
+
+double elapsed_ns(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+double percentile(std::vector<double> values, double p) {
+    std::sort(values.begin(), values.end());
+    size_t i = std::min(values.size() - 1, size_t(p / 100. * values.size()));
+    return values[i];
+}
+
+Vec3f random_direction(std::mt19937& rng) {
+    std::normal_distribution<float> n;
+    Vec3f d(n(rng), n(rng), n(rng));
+    return d.normalize();
+}
+
+// Rays starting around the camera and heading roughly down -z, so most of them run into the scene
+std::vector<Ray> make_camera_rays(int count, std::mt19937& rng) {
+    std::uniform_real_distribution<float> spread(-0.6f, 0.6f);
+    std::vector<Ray> rays(count);
+    for (Ray& ray : rays) {
+        ray.ro = Vec3f(spread(rng), spread(rng), 0);
+        ray.rd = Vec3f(spread(rng), spread(rng), -1).normalize();
+    }
+    return rays;
+}
+
+// Runs kernel(i) for every i in [0, count) config.repeats times and returns the median time per call
+template <typename Kernel>
+double median_ns_per_op(const BenchConfig& config, int count, Kernel kernel) {
+    std::vector<double> runs;
+    for (int r = 0; r < config.repeats; r++) {
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < count; i++) kernel(i);
+        runs.push_back(elapsed_ns(start) / count);
+    }
+    return percentile(runs, 50);
+}
+
+// Results are summed into this so the compiler can not drop the kernels
+volatile float sink;
+
+std::string kernel_json(const char* name, double ns_per_ray) {
+    std::ostringstream out;
+    out << "    {\"name\": \"" << name << "\", \"ns_per_ray\": " << ns_per_ray << ", \"rays_per_sec\": " << 1e9 / ns_per_ray << "}";
+    return out.str();
+}
+
+std::vector<std::string> bench_kernels(const BenchConfig& config) {
+    std::mt19937 rng(config.seed);
+    std::vector<Ray> rays = make_camera_rays(config.rays, rng);
+    std::vector<Vec3f> normals(config.rays);
+    for (Vec3f& n : normals) n = random_direction(rng);
+    Scene scene = make_demo_scene();
+    scene.build_bvh();
+    const Sphere& sphere = scene.spheres[0];
+    std::vector<std::string> results;
+    float acc = 0;
+
+    results.push_back(kernel_json("sphere_ray_intersect", median_ns_per_op(config, config.rays, [&](int i) {
+        float t = 0;
+        if (sphere.ray_intersect(rays[i].ro, rays[i].rd, t)) acc += t;
+    })));
+    results.push_back(kernel_json("scene_intersect", median_ns_per_op(config, config.rays, [&](int i) {
+        HitRecord hit;
+        if (scene_intersect(rays[i].ro, rays[i].rd, scene, hit)) acc += hit.t;
+    })));
+    results.push_back(kernel_json("scene_occluded", median_ns_per_op(config, config.rays, [&](int i) {
+        acc += scene_occluded(rays[i].ro, rays[i].rd, scene, 100.f);
+    })));
+    results.push_back(kernel_json("sample_envmap_cube", median_ns_per_op(config, config.rays, [&](int i) {
+        acc += sample_envmap(rays[i].ro, normals[i]).x;
+    })));
+    envmap.lookup = EnvmapLookup::Exact;
+    results.push_back(kernel_json("sample_envmap_exact", median_ns_per_op(config, config.rays, [&](int i) {
+        acc += sample_envmap(rays[i].ro, normals[i]).x;
+    })));
+    envmap.lookup = EnvmapLookup::Cube;
+    results.push_back(kernel_json("refract", median_ns_per_op(config, config.rays, [&](int i) {
+        acc += refract(rays[i].rd, normals[i], 1.5f).x;
+    })));
+    results.push_back(kernel_json("fresnel", median_ns_per_op(config, config.rays, [&](int i) {
+        float kr;
+        fresnel(rays[i].rd, normals[i], 1.5f, kr);
+        acc += kr;
+    })));
+    sink = acc;
+    return results;
+}
+
+std::string bench_scene(const BenchConfig& config, int sphere_count) {
+    std::mt19937 rng(config.seed);
+    Scene scene = make_random_scene(sphere_count, config.seed + sphere_count);
+    std::vector<Light> lights = make_demo_lights();
+
+    Clock::time_point start = Clock::now();
+    scene.build_bvh();
+    double build_ms = elapsed_ns(start) * 1e-6;
+
+    int ray_count = std::min(config.rays, 1 << 18);
+    std::vector<Ray> rays = make_camera_rays(ray_count, rng);
+    float acc = 0;
+    double intersect_ns = median_ns_per_op(config, ray_count, [&](int i) {
+        HitRecord hit;
+        if (scene_intersect(rays[i].ro, rays[i].rd, scene, hit)) acc += hit.t;
+    });
+    sink = acc;
+
+    RenderOptions options;
+    options.width = config.width;
+    options.height = config.height;
+    options.threads = config.threads;
+    // Only camera rays are counted, the secondary rays they spawn are part of their cost
+    const double primary_rays = double(config.width) * config.height;
+    std::ostringstream out;
+    out << "    {\"spheres\": " << sphere_count
+        << ", \"bvh_build_ms\": " << build_ms
+        << ", \"bvh_nodes\": " << scene.bvh.nodes.size()
+        << ", \"intersect_ns_per_ray\": " << intersect_ns;
+    // The plain keys time camera rays traced one by one, the packet_ ones 8x8 packets
+    for (int packets = 0; packets < 2; packets++) {
+        options.packets = packets != 0;
+        std::vector<double> frame_ms;
+        for (int f = 0; f < config.frames; f++) {
+            start = Clock::now();
+            render(scene, lights, options);
+            frame_ms.push_back(elapsed_ns(start) * 1e-6);
+        }
+        const char* prefix = packets ? "packet_" : "";
+        double p50 = percentile(frame_ms, 50);
+        out << ", \"" << prefix << "primary_rays_per_sec\": " << primary_rays / (p50 * 1e-3)
+            << ", \"" << prefix << "ns_per_primary_ray\": " << p50 * 1e6 / primary_rays
+            << ", \"" << prefix << "frame_ms\": {\"min\": " << percentile(frame_ms, 0)
+            << ", \"p50\": " << p50
+            << ", \"p90\": " << percentile(frame_ms, 90)
+            << ", \"p99\": " << percentile(frame_ms, 99)
+            << ", \"max\": " << percentile(frame_ms, 100) << "}";
+    }
+    out << "}";
+    return out.str();
+}
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [--threads N] [--frames N] [--rays N] [--repeats N] [--max-spheres N]"
+        " [--width W] [--height H] [--seed S] [--out results.json]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    config.threads = std::max(1u, std::thread::hardware_concurrency());
+    const char* out_path = nullptr;
+    for (int a = 1; a < argc; a++) {
+        if (a + 1 >= argc) {
+            print_usage(argv[0]);
+            return -1;
+        }
+        if (!strcmp(argv[a], "--threads")) config.threads = std::max(1, atoi(argv[++a]));
+        else if (!strcmp(argv[a], "--frames")) config.frames = std::max(1, atoi(argv[++a]));
+        else if (!strcmp(argv[a], "--rays")) config.rays = std::max(1, atoi(argv[++a]));
+        else if (!strcmp(argv[a], "--repeats")) config.repeats = std::max(1, atoi(argv[++a]));
+        else if (!strcmp(argv[a], "--max-spheres")) config.max_spheres = std::max(4, atoi(argv[++a]));
+        else if (!strcmp(argv[a], "--width")) config.width = std::max(1, atoi(argv[++a]));
+        else if (!strcmp(argv[a], "--height")) config.height = std::max(1, atoi(argv[++a]));
+        else if (!strcmp(argv[a], "--seed")) config.seed = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "--out")) out_path = argv[++a];
+        else {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (!envmap.load("envmap.jpg")) return -1;
+    envmap.build_cube(0, config.threads);
+    envmap.lookup = EnvmapLookup::Cube;
+
+    std::vector<std::string> kernels = bench_kernels(config);
+    std::vector<std::string> scenes;
+    for (int count = 4; count <= config.max_spheres; count *= 4) {
+        std::cerr << "Benchmarking " << count << " spheres" << std::endl;
+        scenes.push_back(bench_scene(config, count));
+    }
+
+    std::ostringstream json;
+    json << "{\n  \"config\": {\"threads\": " << config.threads << ", \"frames\": " << config.frames
+        << ", \"rays\": " << config.rays << ", \"repeats\": " << config.repeats << ", \"width\": " << config.width
+        << ", \"height\": " << config.height << ", \"seed\": " << config.seed
+        << ", \"simd\": \"" << simd_isa_name(active_sphere_kernels().isa) << "\"},\n";
+    json << "  \"kernels\": [\n";
+    for (size_t i = 0; i < kernels.size(); i++) json << kernels[i] << (i + 1 < kernels.size() ? ",\n" : "\n");
+    json << "  ],\n  \"scenes\": [\n";
+    for (size_t i = 0; i < scenes.size(); i++) json << scenes[i] << (i + 1 < scenes.size() ? ",\n" : "\n");
+    json << "  ]\n}\n";
+
+    if (out_path) {
+        std::ofstream out(out_path);
+        if (!out) {
+            std::cerr << "Error: can not write " << out_path << std::endl;
+            return -1;
+        }
+        out << json.str();
+    }
+    else {
+        std::cout << json.str();
+    }
+    return 0;
+}
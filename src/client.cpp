@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Sends one job to raytracer_server and writes the JPEG it replies with. The job is read from a file or from
+// stdin, see src/server.cpp for its format.
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [--socket PATH] [--out FILE] [--shutdown | JOB_FILE|-]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    const char* socket_path = "raytracer.sock";
+    const char* out_path = "out.jpg";
+    const char* job_path = "-";
+    bool shutdown_server = false;
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "--socket") && a + 1 < argc) socket_path = argv[++a];
+        else if (!strcmp(argv[a], "--out") && a + 1 < argc) out_path = argv[++a];
+        else if (!strcmp(argv[a], "--shutdown")) shutdown_server = true;
+        else if (argv[a][0] != '-' || !strcmp(argv[a], "-")) job_path = argv[a];
+        else {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    std::string request;
+    if (shutdown_server) {
+        request = "shutdown\n";
+    }
+    else if (!strcmp(job_path, "-")) {
+        request.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+    }
+    else {
+        std::ifstream in(job_path, std::ios::binary);
+        if (!in) {
+            std::cerr << "Error: can not open " << job_path << std::endl;
+            return -1;
+        }
+        request.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        std::cerr << "Error: socket path " << socket_path << " is too long" << std::endl;
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        std::cerr << "Error: can not connect to " << socket_path << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    size_t sent = 0;
+    while (sent < request.size()) {
+        ssize_t n = send(fd, request.data() + sent, request.size() - sent, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            std::cerr << "Error: sending the job failed: " << strerror(errno) << std::endl;
+            return -1;
+        }
+        sent += size_t(n);
+    }
+    // Closing our side ends a job without an "end" line
+    shutdown(fd, SHUT_WR);
+
+    std::vector<char> reply;
+    char buffer[1 << 16];
+    for (;;) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            std::cerr << "Error: receiving the reply failed: " << strerror(errno) << std::endl;
+            return -1;
+        }
+        if (n == 0) break;
+        reply.insert(reply.end(), buffer, buffer + n);
+    }
+    close(fd);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    auto newline = std::find(reply.begin(), reply.end(), '\n');
+    std::string header(reply.begin(), newline);
+    if (newline == reply.end() || header.compare(0, 3, "ok ") != 0) {
+        std::cerr << "Error: server replied " << (header.empty() ? "nothing" : header) << std::endl;
+        return -1;
+    }
+    size_t size = strtoull(header.c_str() + 3, nullptr, 10);
+    if (size_t(reply.end() - newline - 1) != size) {
+        std::cerr << "Error: expected " << size << " bytes but got " << (reply.end() - newline - 1) << std::endl;
+        return -1;
+    }
+    if (shutdown_server) {
+        std::cout << "Server is shutting down" << std::endl;
+        return 0;
+    }
+    std::ofstream out(out_path, std::ios::binary);
+    if (!out.write(&*(newline + 1), size)) {
+        std::cerr << "Error: can not write " << out_path << std::endl;
+        return -1;
+    }
+    std::cout << "Received " << size << " bytes in " << elapsed.count() << " ms, written to " << out_path << std::endl;
+    return 0;
+}
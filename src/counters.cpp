@@ -0,0 +1,108 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include "counters.h"
+#include "geometry.h"
+#include "stb_image_write.h"
+
+#ifdef RAYTRACER_COUNTERS
+thread_local RayCounters thread_counters;
+#endif
+
+namespace {
+
+struct CounterField {
+    const char* name;
+    uint64_t RayCounters::*member;
+};
+
+const CounterField COUNTER_FIELDS[] = {
+    { "primary_rays", &RayCounters::primary_rays },
+    { "shadow_rays", &RayCounters::shadow_rays },
+    { "reflection_rays", &RayCounters::reflection_rays },
+    { "refraction_rays", &RayCounters::refraction_rays },
+    { "sphere_tests", &RayCounters::sphere_tests },
+    { "node_visits", &RayCounters::node_visits },
+    { "cycles", &RayCounters::cycles },
+};
+
+uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+    return sorted[std::min(sorted.size() - 1, size_t(p / 100. * sorted.size()))];
+}
+
+// Black through blue, red and yellow to white
+Vec3uc heat_color(float t) {
+    static const float ramp[5][3] = { { 0, 0, 0 }, { 0, 0, 1 }, { 1, 0, 0 }, { 1, 1, 0 }, { 1, 1, 1 } };
+    t = std::min(1.f, std::max(0.f, t)) * 4.f;
+    const int k = std::min(3, int(t));
+    const float f = t - k;
+    float c[3];
+    for (int i = 0; i < 3; i++) c[i] = ramp[k][i] + (ramp[k + 1][i] - ramp[k][i]) * f;
+    return Vec3uc(int(c[0] * 255), int(c[1] * 255), int(c[2] * 255));
+}
+
+}
+
+bool write_counters(const std::string& prefix, int width, int height, const std::vector<RayCounters>& pixels) {
+    std::vector<uint64_t> cycles(pixels.size());
+    for (size_t p = 0; p < pixels.size(); p++) cycles[p] = pixels[p].cycles;
+    std::sort(cycles.begin(), cycles.end());
+    const double scale = 1. / std::max<uint64_t>(1, percentile(cycles, 99));
+
+    std::vector<Vec3uc> heatmap(pixels.size());
+    for (size_t p = 0; p < pixels.size(); p++) heatmap[p] = heat_color(float(pixels[p].cycles * scale));
+    const std::string heatmap_path = prefix + "_heatmap.jpg";
+    if (!stbi_write_jpg(heatmap_path.c_str(), width, height, 3, heatmap.data(), 90)) {
+        std::cerr << "Error: can not write " << heatmap_path << std::endl;
+        return false;
+    }
+
+    const std::string csv_path = prefix + "_counters.csv";
+    FILE* csv = fopen(csv_path.c_str(), "w");
+    if (!csv) {
+        std::cerr << "Error: can not write " << csv_path << std::endl;
+        return false;
+    }
+    fprintf(csv, "x,y");
+    for (const CounterField& field : COUNTER_FIELDS) fprintf(csv, ",%s", field.name);
+    fprintf(csv, "\n");
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const RayCounters& c = pixels[x + y * width];
+            fprintf(csv, "%d,%d", x, y);
+            for (const CounterField& field : COUNTER_FIELDS) fprintf(csv, ",%llu", (unsigned long long)(c.*field.member));
+            fprintf(csv, "\n");
+        }
+    }
+    if (fclose(csv) != 0) {
+        std::cerr << "Error: can not write " << csv_path << std::endl;
+        return false;
+    }
+
+    const std::string json_path = prefix + "_counters.json";
+    std::ofstream json(json_path);
+    json << "{\n  \"width\": " << width << ", \"height\": " << height << ",\n  \"counters\": {\n";
+    std::vector<uint64_t> values(pixels.size());
+    for (size_t f = 0; f < sizeof(COUNTER_FIELDS) / sizeof(COUNTER_FIELDS[0]); f++) {
+        const CounterField& field = COUNTER_FIELDS[f];
+        uint64_t total = 0;
+        for (size_t p = 0; p < pixels.size(); p++) {
+            values[p] = pixels[p].*field.member;
+            total += values[p];
+        }
+        std::sort(values.begin(), values.end());
+        json << "    \"" << field.name << "\": {\"total\": " << total << ", \"mean\": " << double(total) / pixels.size()
+            << ", \"p50\": " << percentile(values, 50) << ", \"p90\": " << percentile(values, 90) << ", \"p99\": " << percentile(values, 99)
+            << ", \"max\": " << values.back() << "}" << (f + 1 < sizeof(COUNTER_FIELDS) / sizeof(COUNTER_FIELDS[0]) ? ",\n" : "\n");
+    }
+    json << "  }\n}\n";
+    json.close();
+    if (!json) {
+        std::cerr << "Error: can not write " << json_path << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,168 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "envmap.h"
+#include "scheduler.h"
+#include "stb_image.h"
+#include "trace.h"
+
+bool Envmap::load(const char* path) {
+    TraceSpan span("envmap decode", "load");
+    int n = -1;
+    unsigned char* pixmap = stbi_load(path, &width, &height, &n, 0);
+    if (!pixmap || 3 != n) {
+        std::cerr << "Error: can not load the environment map" << std::endl;
+        return false;
+    }
+    mapping.close();
+    pixel_storage = std::vector<Vec3f>(width * height);
+    for (int j = height - 1; j >= 0; j--) {
+        for (int i = 0; i < width; i++) {
+            pixel_storage[i + j * width] = Vec3f(pixmap[(i + j * width) * 3 + 0], pixmap[(i + j * width) * 3 + 1], pixmap[(i + j * width) * 3 + 2]) * (1 / 255.);
+        }
+    }
+    stbi_image_free(pixmap);
+    pixels = pixel_storage.data();
+    cube_storage.clear();
+    cube = nullptr;
+    face_size = 0;
+    return true;
+}
+
+void Envmap::build_cube(int size, int threads) {
+    TraceSpan span("envmap cube", "load");
+    face_size = size > 0 ? size : std::max(1, width / 4);
+    cube_storage.resize(6 * face_size * face_size);
+    // One work item per face row
+    parallel_for_stealing(6 * face_size, threads, [&](int, int row) {
+        int face = row / face_size, v = row % face_size;
+        float tc = 2.f * (v + 0.5f) / face_size - 1.f;
+        for (int u = 0; u < face_size; u++) {
+            float sc = 2.f * (u + 0.5f) / face_size - 1.f;
+            Vec3f d;
+            switch (face) {
+            case 0: d = Vec3f(1, -tc, -sc); break;
+            case 1: d = Vec3f(-1, -tc, sc); break;
+            case 2: d = Vec3f(sc, 1, tc); break;
+            case 3: d = Vec3f(sc, -1, -tc); break;
+            case 4: d = Vec3f(sc, -tc, 1); break;
+            default: d = Vec3f(-sc, -tc, -1); break;
+            }
+            cube_storage[row * face_size + u] = sample_exact(d.normalize());
+        }
+    });
+    cube = cube_storage.data();
+}
+
+namespace {
+
+const char CACHE_MAGIC[8] = { 'R', 'T', 'E', 'N', 'V', 'M', 'A', 'P' };
+// 2: cube texels sampled with the float acos and atan2
+const uint32_t CACHE_VERSION = 2;
+const uint32_t CACHE_ENDIAN_TAG = 0x01020304;
+
+// Little endian on every machine we render on, endian_tag catches a cache copied anywhere else
+struct EnvmapCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_tag;
+    uint64_t source_size;
+    int64_t source_mtime;
+    int32_t width, height;
+    int32_t face_size;
+    int32_t reserved;
+    // Byte offsets of the RGB float arrays from the start of the file, cube_offset is 0 without a cube map
+    uint64_t pixels_offset;
+    uint64_t cube_offset;
+};
+
+}
+
+bool Envmap::write_cache(const char* cache_path, const FileStamp& source) const {
+    EnvmapCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.endian_tag = CACHE_ENDIAN_TAG;
+    header.source_size = source.size;
+    header.source_mtime = source.mtime;
+    header.width = width;
+    header.height = height;
+    header.face_size = cube ? face_size : 0;
+    uint64_t pixels_bytes = uint64_t(width) * height * sizeof(Vec3f);
+    uint64_t cube_bytes = cube ? uint64_t(6) * face_size * face_size * sizeof(Vec3f) : 0;
+    header.pixels_offset = align_up(sizeof(header));
+    header.cube_offset = cube ? align_up(header.pixels_offset + pixels_bytes) : 0;
+
+    // Written next to the cache and renamed over it, so a concurrent run never maps a half written file
+    std::string tmp_path = std::string(cache_path) + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "wb");
+    if (!f) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+        && write_padding(f, sizeof(header), header.pixels_offset)
+        && fwrite(pixels, 1, pixels_bytes, f) == pixels_bytes;
+    if (ok && cube) {
+        ok = write_padding(f, header.pixels_offset + pixels_bytes, header.cube_offset)
+            && fwrite(cube, 1, cube_bytes, f) == cube_bytes;
+    }
+    ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+    if (ok) remove(cache_path);
+#endif
+    if (!ok || rename(tmp_path.c_str(), cache_path) != 0) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Envmap::map_cache(const char* cache_path, const FileStamp& source) {
+    MappedFile file;
+    if (!file.open(cache_path) || file.size() < sizeof(EnvmapCacheHeader)) return false;
+    EnvmapCacheHeader header;
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) || header.version != CACHE_VERSION
+        || header.endian_tag != CACHE_ENDIAN_TAG || header.source_size != source.size
+        || header.source_mtime != source.mtime || header.width <= 0 || header.height <= 0) {
+        return false;
+    }
+    uint64_t pixels_bytes = uint64_t(header.width) * header.height * sizeof(Vec3f);
+    uint64_t cube_bytes = uint64_t(6) * header.face_size * header.face_size * sizeof(Vec3f);
+    if (header.pixels_offset + pixels_bytes > file.size()
+        || (header.cube_offset && header.cube_offset + cube_bytes > file.size())) {
+        return false;
+    }
+
+    pixel_storage.clear();
+    cube_storage.clear();
+    mapping.close();
+    width = header.width;
+    height = header.height;
+    pixels = reinterpret_cast<const Vec3f*>(file.data() + header.pixels_offset);
+    face_size = header.cube_offset ? header.face_size : 0;
+    cube = header.cube_offset ? reinterpret_cast<const Vec3f*>(file.data() + header.cube_offset) : nullptr;
+    mapping.swap(file);
+    return true;
+}
+
+bool Envmap::load_cached(const char* path, const char* cache_path, bool with_cube, int threads, bool& from_cache) {
+    TraceSpan span("envmap cache", "load");
+    FileStamp source;
+    if (!file_stamp(path, source)) {
+        std::cerr << "Error: can not load the environment map" << std::endl;
+        return false;
+    }
+    from_cache = map_cache(cache_path, source);
+    if (from_cache && (cube || !with_cube)) return true;
+
+    if (!from_cache && !load(path)) return false;
+    if (with_cube) build_cube(0, threads);
+    if (!write_cache(cache_path, source)) {
+        std::cerr << "Warning: can not write the environment map cache " << cache_path << std::endl;
+    }
+    from_cache = false;
+    return true;
+}
@@ -0,0 +1,67 @@
+#include "hash.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Finalizer of splitmix64
+inline uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+}
+
+std::string Digest::hex() const {
+    char text[33];
+    snprintf(text, sizeof(text), "%016llx%016llx", (unsigned long long)hi, (unsigned long long)lo);
+    return text;
+}
+
+void Hasher::word(uint64_t w) {
+    a = rotl(a ^ (w * 0x87c37b91114253d5ull), 31) * 0x4cf5ad432745937full;
+    b = rotl(b ^ (w * 0x52dce729da3ed7c3ull), 29) * 0x9e3779b97f4a7c15ull + a;
+}
+
+void Hasher::bytes(const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    length += size;
+    if (tail_size > 0) {
+        const size_t n = std::min(sizeof(tail) - tail_size, size);
+        memcpy(tail + tail_size, p, n);
+        tail_size += n;
+        p += n;
+        size -= n;
+        if (tail_size < sizeof(tail)) return;
+        uint64_t w;
+        memcpy(&w, tail, 8);
+        word(w);
+        tail_size = 0;
+    }
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        word(w);
+    }
+    memcpy(tail, p, size);
+    tail_size += size;
+}
+
+Digest Hasher::digest() const {
+    Hasher h = *this;
+    uint64_t w = 0;
+    memcpy(&w, tail, tail_size);
+    h.word(w);
+    h.word(length);
+    Digest d;
+    d.hi = mix(h.a ^ rotl(h.b, 17));
+    d.lo = mix(h.b + d.hi);
+    return d;
+}
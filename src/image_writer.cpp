@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <utility>
+#include "image_writer.h"
+#include "stb_image_write.h"
+#include "trace.h"
+
+ImageWriter::ImageWriter(int threads, size_t capacity) : capacity(std::max<size_t>(1, capacity)) {
+    for (int t = 0; t < std::max(1, threads); t++) {
+        encoders.emplace_back([this, t]() {
+            trace_thread_name(("encoder " + std::to_string(t)).c_str());
+            run();
+        });
+    }
+}
+
+ImageWriter::~ImageWriter() {
+    finish();
+}
+
+bool write_file(const std::string& path, const void* data, size_t size) {
+    const std::string tmp_path = path + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "wb");
+    bool ok = f && fwrite(data, 1, size, f) == size;
+    if (f) ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+    if (ok) remove(path.c_str());
+#endif
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        remove(tmp_path.c_str());
+        std::cerr << "Error: can not write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool ImageWriter::write_jpg(const std::string& path, int width, int height, std::vector<Vec3uc> framebuffer, int quality, EncodedFn done) {
+    return push({ path, width, height, quality, std::move(framebuffer), std::move(done) });
+}
+
+bool ImageWriter::encode_jpg(int width, int height, std::vector<Vec3uc> framebuffer, int quality, EncodedFn done) {
+    return push({ std::string(), width, height, quality, std::move(framebuffer), std::move(done) });
+}
+
+bool ImageWriter::push(Job job) {
+    auto start = std::chrono::steady_clock::now();
+    TraceSpan span("encode queue wait", "encode");
+    std::unique_lock<std::mutex> lock(mutex);
+    slot_free.wait(lock, [&]() { return stopping || queue.size() < capacity; });
+    stats.wait_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    // The encoders may already have drained the queue and exited, nothing would ever pick the image up
+    if (stopping) {
+        stats.failed++;
+        lock.unlock();
+        std::cerr << "Error: " << (job.path.empty() ? std::string("an image") : job.path) << " was queued after the encoders stopped" << std::endl;
+        if (job.done) job.done(false, std::vector<unsigned char>());
+        return false;
+    }
+    queue.push_back(std::move(job));
+    job_ready.notify_one();
+    return true;
+}
+
+ImageWriterStats ImageWriter::finish() {
+    TraceSpan span("encode drain", "encode");
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        job_ready.notify_all();
+        slot_free.notify_all();
+    }
+    for (std::thread& encoder : encoders) encoder.join();
+    encoders.clear();
+    return stats;
+}
+
+void ImageWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        job_ready.wait(lock, [&]() { return stopping || !queue.empty(); });
+        // Stopping still drains the queue
+        if (queue.empty()) return;
+        Job job = std::move(queue.front());
+        queue.pop_front();
+        slot_free.notify_one();
+        lock.unlock();
+
+        TraceSpan span("encode", "encode");
+        span.arg("width", job.width);
+        span.arg("height", job.height);
+        auto start = std::chrono::steady_clock::now();
+        bool ok;
+        std::vector<unsigned char> jpeg;
+        if (job.done) {
+            ok = stbi_write_jpg_to_func([](void* context, void* data, int size) {
+                std::vector<unsigned char>& out = *static_cast<std::vector<unsigned char>*>(context);
+                out.insert(out.end(), static_cast<unsigned char*>(data), static_cast<unsigned char*>(data) + size);
+            }, &jpeg, job.width, job.height, 3, job.framebuffer.data(), job.quality) != 0;
+            if (ok && !job.path.empty()) ok = write_file(job.path, jpeg.data(), jpeg.size());
+        }
+        else {
+            ok = stbi_write_jpg(job.path.c_str(), job.width, job.height, 3, job.framebuffer.data(), job.quality) != 0;
+            if (!ok) std::cerr << "Error: can not write " << job.path << std::endl;
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (job.done) job.done(ok, jpeg);
+
+        lock.lock();
+        stats.images++;
+        if (!ok) stats.failed++;
+        stats.encode_ms += ms;
+        stats.max_encode_ms = std::max(stats.max_encode_ms, ms);
+    }
+}
@@ -0,0 +1,96 @@
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <sys/stat.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::open(const char* path) {
+    close();
+#ifdef _WIN32
+    HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (f == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(f, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(f);
+        return false;
+    }
+    HANDLE m = CreateFileMappingA(f, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m) {
+        CloseHandle(f);
+        return false;
+    }
+    void* view = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    if (!view) {
+        CloseHandle(m);
+        CloseHandle(f);
+        return false;
+    }
+    file = f;
+    mapping = m;
+    ptr = static_cast<const uint8_t*>(view);
+    length = size_t(file_size.QuadPart);
+#else
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void* view = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file alive on its own
+    ::close(fd);
+    if (view == MAP_FAILED) return false;
+    ptr = static_cast<const uint8_t*>(view);
+    length = size_t(st.st_size);
+#endif
+    return true;
+}
+
+void MappedFile::close() {
+    if (!ptr) return;
+#ifdef _WIN32
+    UnmapViewOfFile(ptr);
+    CloseHandle(mapping);
+    CloseHandle(file);
+    mapping = file = nullptr;
+#else
+    munmap(const_cast<uint8_t*>(ptr), length);
+#endif
+    ptr = nullptr;
+    length = 0;
+}
+
+void MappedFile::swap(MappedFile& other) {
+    std::swap(ptr, other.ptr);
+    std::swap(length, other.length);
+#ifdef _WIN32
+    std::swap(file, other.file);
+    std::swap(mapping, other.mapping);
+#endif
+}
+
+bool file_stamp(const char* path, FileStamp& stamp) {
+    struct stat st;
+    if (stat(path, &st) != 0) return false;
+    stamp.size = uint64_t(st.st_size);
+    stamp.mtime = int64_t(st.st_mtime);
+    return true;
+}
+
+bool write_padding(FILE* f, uint64_t from, uint64_t to) {
+    static const char zeros[FILE_SECTION_ALIGNMENT] = {};
+    while (from < to) {
+        size_t n = size_t(std::min<uint64_t>(to - from, FILE_SECTION_ALIGNMENT));
+        if (fwrite(zeros, 1, n, f) != n) return false;
+        from += n;
+    }
+    return true;
+}
@@ -0,0 +1,94 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include "mesh.h"
+#include "trace.h"
+
+void TriangleMesh::build_bvh() {
+    TraceSpan span("mesh bvh build", "load");
+    std::vector<AABB> bounds(triangle_count());
+    for (size_t i = 0; i < bounds.size(); i++) {
+        for (int k = 0; k < 3; k++) bounds[i].expand(vertices[indices[3 * i + k]]);
+    }
+    bvh.build(bounds);
+}
+
+namespace {
+
+// Parses the vertex index of one face corner ("7", "7/1", "7//3" or "7/1/3") and makes it 0 based
+bool parse_corner(const char*& p, size_t vertex_count, uint32_t& index) {
+    char* end;
+    long i = strtol(p, &end, 10);
+    if (end == p || i == 0) return false;
+    // Skip the texture and normal indices
+    while (*end && *end != ' ' && *end != '\t' && *end != '\r' && *end != '\n') end++;
+    p = end;
+    long resolved = i > 0 ? i - 1 : long(vertex_count) + i;
+    if (resolved < 0 || size_t(resolved) >= vertex_count) return false;
+    index = uint32_t(resolved);
+    return true;
+}
+
+}
+
+bool load_obj(const char* path, TriangleMesh& mesh) {
+    TraceSpan span("mesh load", "load");
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Error: can not open " << path << std::endl;
+        return false;
+    }
+    mesh.vertices.clear();
+    mesh.indices.clear();
+
+    // One line at a time, the file is never held in memory
+    std::string line;
+    size_t line_number = 0;
+    bool ok = true;
+    while (ok && std::getline(in, line)) {
+        line_number++;
+        const char* p = line.c_str();
+        while (*p == ' ' || *p == '\t') p++;
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            char* end;
+            float x = strtof(p + 2, &end);
+            float y = strtof(end, &end);
+            float z = strtof(end, &end);
+            mesh.vertices.push_back(Vec3f(x, y, z));
+        }
+        else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            p += 2;
+            uint32_t first = 0, prev = 0, index = 0;
+            int corners = 0;
+            for (;;) {
+                while (*p == ' ' || *p == '\t') p++;
+                if (!*p || *p == '\r' || *p == '\n' || *p == '#') break;
+                if (!parse_corner(p, mesh.vertices.size(), index)) {
+                    ok = false;
+                    break;
+                }
+                if (corners == 0) first = index;
+                else if (corners >= 2) {
+                    mesh.indices.push_back(first);
+                    mesh.indices.push_back(prev);
+                    mesh.indices.push_back(index);
+                }
+                prev = index;
+                corners++;
+            }
+            if (corners < 3) ok = false;
+        }
+        // Normals, texture coordinates, groups, materials and comments are ignored
+    }
+
+    if (!ok) {
+        std::cerr << "Error: malformed face in " << path << " on line " << line_number << std::endl;
+        return false;
+    }
+    if (mesh.indices.empty()) {
+        std::cerr << "Error: " << path << " has no faces" << std::endl;
+        return false;
+    }
+    return true;
+}
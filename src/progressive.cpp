@@ -0,0 +1,97 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "progressive.h"
+#include "scheduler.h"
+#include "trace.h"
+
+namespace {
+
+// Whether pass (step) renders pixel (i, j): it lies on the pass's grid but not on the grid of the pass before
+bool in_pass(int i, int j, int step) {
+    if (i % step || j % step) return false;
+    return step == PROGRESSIVE_FIRST_STEP || (i % (2 * step)) || (j % (2 * step));
+}
+
+}
+
+std::vector<Vec3uc> render_progressive(const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options,
+    int interval_ms, const PreviewFn& preview) {
+    TraceSpan span("frame");
+    const int width = options.width;
+    const int height = options.height;
+    const Camera camera(options);
+    // Workers write a color, then publish it through done. The preview thread only reads colors it saw published.
+    std::vector<Vec3f> accumulation(width * height);
+    std::unique_ptr<std::atomic<bool>[]> done(new std::atomic<bool>[width * height]);
+    for (int p = 0; p < width * height; p++) done[p].store(false, std::memory_order_relaxed);
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    int finished_passes = 0;
+    bool finished = false;
+    std::thread preview_thread([&]() {
+        trace_thread_name("preview");
+        std::vector<Vec3uc> image(width * height);
+        std::unique_lock<std::mutex> lock(mutex);
+        int shown = 0;
+        for (;;) {
+            wake.wait_for(lock, std::chrono::milliseconds(interval_ms), [&]() { return finished || finished_passes != shown; });
+            if (finished) return;
+            shown = finished_passes;
+            lock.unlock();
+            TraceSpan span("preview");
+            span.arg("passes", shown);
+            for (int j = 0; j < height; j++) {
+                for (int i = 0; i < width; i++) {
+                    Vec3uc pixel(0, 0, 0);
+                    for (int step = 1; step <= PROGRESSIVE_FIRST_STEP; step *= 2) {
+                        const int source = (i - i % step) + (j - j % step) * width;
+                        if (done[source].load(std::memory_order_acquire)) {
+                            pixel = to_pixel(accumulation[source]);
+                            break;
+                        }
+                    }
+                    image[i + j * width] = pixel;
+                }
+            }
+            preview(image, shown);
+            lock.lock();
+        }
+    });
+
+    const std::vector<Tile> tiles = make_tiles(width, height, options.tile_size);
+    for (int step = PROGRESSIVE_FIRST_STEP; step >= 1; step /= 2) {
+        TraceSpan pass_span("pass");
+        pass_span.arg("step", step);
+        parallel_for_stealing(tiles.size(), options.threads, [&](int, int t) {
+            const Tile& tile = tiles[t];
+            TraceSpan span("tile");
+            span.arg("x", tile.x0);
+            span.arg("y", tile.y0);
+            for (int j = tile.y0; j < tile.y1; j++) {
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    if (!in_pass(i, j, step)) continue;
+                    accumulation[i + j * width] = cast_ray(camera.origin, camera.direction(i + 0.5f, j + 0.5f), scene, lights, options);
+                    done[i + j * width].store(true, std::memory_order_release);
+                }
+            }
+        });
+        std::lock_guard<std::mutex> lock(mutex);
+        finished_passes++;
+        wake.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+        wake.notify_one();
+    }
+    preview_thread.join();
+
+    std::vector<Vec3uc> framebuffer(width * height);
+    for (int p = 0; p < width * height; p++) framebuffer[p] = to_pixel(accumulation[p]);
+    return framebuffer;
+}
@@ -0,0 +1,89 @@
+#include <algorithm>
+#include "relight.h"
+#include "trace.h"
+
+std::vector<Vec3uc> RelightCache::build(const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options) {
+    TraceSpan span("relight cache build");
+    const Camera camera(options);
+    const std::vector<Tile> layout = make_tiles(options.width, options.height, options.tile_size);
+    tiles.assign(layout.size(), CachedTile());
+    parallel_for_stealing(layout.size(), options.threads, [&](int, int t) {
+        CachedTile& cached = tiles[t];
+        cached.tile = layout[t];
+        for (int j = cached.tile.y0; j < cached.tile.y1; j++) {
+            for (int i = cached.tile.x0; i < cached.tile.x1; i++) {
+                trace_shading_points(camera.origin, camera.direction(i + 0.5f, j + 0.5f), scene, options, cached.points);
+                cached.pixel_end.push_back(uint32_t(cached.points.size()));
+            }
+        }
+        cached.points.shrink_to_fit();
+    });
+    // Every light counts as changed
+    cached_lights.clear();
+    return relight(scene, lights, options);
+}
+
+std::vector<Vec3uc> RelightCache::relight(const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options, RelightStats* stats) {
+    TraceSpan span("relight");
+    const size_t light_count = lights.size();
+    const bool same_count = cached_lights.size() == light_count;
+    std::vector<char> moved(light_count);
+    int changed = 0;
+    for (size_t l = 0; l < light_count; l++) {
+        const Vec3f& a = lights[l].position;
+        moved[l] = !same_count || a.x != cached_lights[l].position.x || a.y != cached_lights[l].position.y || a.z != cached_lights[l].position.z;
+        changed += moved[l] || lights[l].intensity != cached_lights[l].intensity;
+    }
+
+    std::vector<Vec3uc> framebuffer(options.width * options.height);
+    std::vector<uint64_t> worker_rays(options.threads);
+    parallel_for_stealing(tiles.size(), options.threads, [&](int worker, int t) {
+        TraceSpan tile_span("tile");
+        CachedTile& cached = tiles[t];
+        if (!same_count) cached.factors.assign(2 * cached.points.size() * light_count, 0.f);
+        for (size_t p = 0; p < cached.points.size(); p++) {
+            const ShadingPoint& point = cached.points[p];
+            if (point.material == ShadingPoint::ENVIRONMENT) continue;
+            for (size_t l = 0; l < light_count; l++) {
+                if (!moved[l]) continue;
+                float* f = &cached.factors[2 * (p * light_count + l)];
+                light_factors(point, lights[l], scene, f[0], f[1]);
+                worker_rays[worker]++;
+            }
+        }
+
+        // Summed in the order render() adds the same terms up
+        const Tile& tile = cached.tile;
+        size_t p = 0, k = 0;
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++, k++) {
+                Vec3f color(0., 0., 0.);
+                for (; p < cached.pixel_end[k]; p++) {
+                    float diffuse_light_intensity = 0.f;
+                    float specular_light_intensity = 0.f;
+                    const float* f = &cached.factors[2 * p * light_count];
+                    for (size_t l = 0; l < light_count; l++) {
+                        diffuse_light_intensity += lights[l].intensity * f[2 * l];
+                        specular_light_intensity += f[2 * l + 1] * lights[l].intensity;
+                    }
+                    color += shade_point(cached.points[p], scene, diffuse_light_intensity, specular_light_intensity);
+                }
+                framebuffer[i + j * options.width] = to_pixel(color);
+            }
+        }
+    });
+    cached_lights = lights;
+
+    if (stats) {
+        stats->changed_lights = changed;
+        stats->shadow_rays = 0;
+        for (uint64_t rays : worker_rays) stats->shadow_rays += rays;
+    }
+    return framebuffer;
+}
+
+size_t RelightCache::point_count() const {
+    size_t count = 0;
+    for (const CachedTile& cached : tiles) count += cached.points.size();
+    return count;
+}
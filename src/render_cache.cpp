@@ -0,0 +1,267 @@
+#include "render_cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#include "scene_file.h"
+#include "trace.h"
+
+namespace {
+
+// Bump whenever shading or the scene file format changes, so entries written by older builds are not returned.
+// 3: scene files store their digest.
+const uint64_t RENDER_CACHE_VERSION = 3;
+
+}
+
+Digest hash_geometry(const Scene& scene) {
+    TraceSpan span("geometry hash", "load");
+    Hasher h;
+    h.u64(RENDER_CACHE_VERSION);
+    if (scene.mapping) {
+        h.u64(scene.file_digest.hi);
+        h.u64(scene.file_digest.lo);
+        return h.digest();
+    }
+    h.u64(scene.materials.size());
+    for (const Material& m : scene.materials) {
+        h.vec(m.color);
+        h.f32(m.diffuse);
+        h.f32(m.specular);
+        h.f32(m.shininess);
+        h.f32(m.ambient);
+        h.f32(m.reflectivity);
+        h.f32(m.refractivity);
+        h.f32(m.ior);
+    }
+    h.u64(scene.spheres.size());
+    for (const Sphere& s : scene.spheres) {
+        h.vec(s.center);
+        h.f32(s.radius);
+        h.u64(s.material);
+    }
+    h.u64(scene.meshes.size());
+    for (const TriangleMesh& mesh : scene.meshes) {
+        h.u64(mesh.material);
+        h.u64(mesh.vertices.size());
+        for (const Vec3f& v : mesh.vertices) h.vec(v);
+        h.u64(mesh.indices.size());
+        h.bytes(mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+    }
+    return h.digest();
+}
+
+Digest hash_render(const Digest& geometry, const std::vector<Light>& lights, const RenderOptions& options, const FileStamp& envmap_source) {
+    Hasher h;
+    h.u64(RENDER_CACHE_VERSION);
+    h.u64(geometry.hi);
+    h.u64(geometry.lo);
+    h.u64(lights.size());
+    for (const Light& light : lights) {
+        h.vec(light.position);
+        h.f32(light.intensity);
+    }
+    h.u64(uint64_t(options.width));
+    h.u64(uint64_t(options.height));
+    h.vec(options.camera_origin);
+    h.f32(options.fov);
+    h.f32(options.min_weight);
+    h.u64(uint64_t(options.max_depth));
+    h.u64(uint64_t(options.samples));
+    if (options.samples > 1) h.f32(options.sample_error);
+    h.u64(envmap_source.size);
+    h.u64(uint64_t(envmap_source.mtime));
+    const bool cube = envmap.lookup == EnvmapLookup::Cube && envmap.cube;
+    h.u64(cube ? uint64_t(envmap.face_size) : 0);
+    return h.digest();
+}
+
+Digest hash_jpeg(const Digest& frame, int quality) {
+    Hasher h;
+    h.u64(RENDER_CACHE_VERSION);
+    h.bytes("jpeg", 4);
+    h.u64(frame.hi);
+    h.u64(frame.lo);
+    h.u64(uint64_t(quality));
+    return h.digest();
+}
+
+bool RenderCache::open(const std::string& dir, uint64_t limit) {
+    std::lock_guard<std::mutex> lock(mutex);
+    directory = dir;
+    max_bytes = limit;
+#ifdef _WIN32
+    int made = _mkdir(dir.c_str());
+#else
+    int made = mkdir(dir.c_str(), 0755);
+#endif
+    struct stat st;
+    if ((made != 0 && errno != EEXIST) || stat(dir.c_str(), &st) != 0 || !(st.st_mode & S_IFDIR)) {
+        std::cerr << "Error: can not use " << dir << " as the render cache" << std::endl;
+        return false;
+    }
+
+    // "name bytes last_use" per line, entries whose file is gone or changed size are dropped
+    entries.clear();
+    clock = 0;
+    std::ifstream in(path("index"));
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        Entry entry;
+        FileStamp stamp;
+        if (!(fields >> entry.name >> entry.bytes >> entry.last_use)) continue;
+        if (!file_stamp(path(entry.name).c_str(), stamp) || stamp.size != entry.bytes) continue;
+        clock = std::max(clock, entry.last_use);
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+RenderCacheStats RenderCache::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counts;
+}
+
+uint64_t RenderCache::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return total_bytes();
+}
+
+uint64_t RenderCache::total_bytes() const {
+    uint64_t total = 0;
+    for (const Entry& entry : entries) total += entry.bytes;
+    return total;
+}
+
+RenderCache::Entry* RenderCache::find(const std::string& name) {
+    for (Entry& entry : entries) {
+        if (entry.name == name) return &entry;
+    }
+    return nullptr;
+}
+
+void RenderCache::touch(Entry& entry) {
+    entry.last_use = ++clock;
+    dirty = true;
+}
+
+void RenderCache::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (dirty) save_index();
+}
+
+void RenderCache::add(const std::string& name) {
+    FileStamp stamp;
+    if (!file_stamp(path(name).c_str(), stamp)) return;
+    if (stamp.size > max_bytes) {
+        remove(path(name).c_str());
+        return;
+    }
+    entries.push_back({ name, stamp.size, ++clock });
+    evict(name);
+    save_index();
+}
+
+void RenderCache::evict(const std::string& keep) {
+    uint64_t total = total_bytes();
+    while (total > max_bytes) {
+        auto oldest = entries.end();
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->name != keep && (oldest == entries.end() || it->last_use < oldest->last_use)) oldest = it;
+        }
+        if (oldest == entries.end()) break;
+        // Scenes mapped by this process stay readable, the mapping keeps the file alive
+        remove(path(oldest->name).c_str());
+        total -= oldest->bytes;
+        entries.erase(oldest);
+        counts.evictions++;
+    }
+}
+
+void RenderCache::save_index() {
+    dirty = false;
+    std::string index = path("index"), tmp = index + ".tmp";
+    {
+        std::ofstream out(tmp);
+        for (const Entry& entry : entries) out << entry.name << " " << entry.bytes << " " << entry.last_use << "\n";
+        if (!out) return;
+    }
+#ifdef _WIN32
+    remove(index.c_str());
+#endif
+    if (rename(tmp.c_str(), index.c_str()) != 0) remove(tmp.c_str());
+}
+
+bool RenderCache::load_jpeg(const Digest& key, std::vector<unsigned char>& jpeg) {
+    TraceSpan span("render cache lookup", "cache");
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry* entry = find(key.hex() + ".jpg");
+    MappedFile file;
+    // A JPEG starts with the SOI marker and ends with EOI, anything else was cut short or overwritten
+    bool ok = entry && file.open(path(entry->name).c_str()) && file.size() >= 4 && file.data()[0] == 0xFF && file.data()[1] == 0xD8
+        && file.data()[file.size() - 2] == 0xFF && file.data()[file.size() - 1] == 0xD9;
+    if (!ok) {
+        counts.image_misses++;
+        return false;
+    }
+    jpeg.assign(file.data(), file.data() + file.size());
+    counts.image_hits++;
+    touch(*entry);
+    return true;
+}
+
+void RenderCache::store_jpeg(const Digest& key, const std::vector<unsigned char>& jpeg) {
+    TraceSpan span("render cache store", "cache");
+    std::lock_guard<std::mutex> lock(mutex);
+    const std::string name = key.hex() + ".jpg";
+    if (Entry* entry = find(name)) {
+        touch(*entry);
+        return;
+    }
+    const std::string final_path = path(name), tmp_path = final_path + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "wb");
+    bool ok = f && fwrite(jpeg.data(), 1, jpeg.size(), f) == jpeg.size();
+    if (f) ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+    if (ok) remove(final_path.c_str());
+#endif
+    if (!ok || rename(tmp_path.c_str(), final_path.c_str()) != 0) {
+        remove(tmp_path.c_str());
+        std::cerr << "Error: can not write " << final_path << std::endl;
+        return;
+    }
+    add(name);
+}
+
+bool RenderCache::load_scene(const Digest& key, Scene& scene) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry* entry = find(key.hex() + ".scene");
+    Scene mapped;
+    if (!entry || !map_scene(path(entry->name).c_str(), mapped)) {
+        counts.scene_misses++;
+        return false;
+    }
+    scene = std::move(mapped);
+    counts.scene_hits++;
+    touch(*entry);
+    return true;
+}
+
+void RenderCache::store_scene(const Digest& key, const Scene& scene) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const std::string name = key.hex() + ".scene";
+    if (Entry* entry = find(name)) {
+        touch(*entry);
+        return;
+    }
+    if (write_scene(path(name).c_str(), scene)) add(name);
+}
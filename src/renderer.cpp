@@ -0,0 +1,713 @@
+#define _CRT_SECURE_NO_WARNINGS
+#define _USE_MATH_DEFINES
+
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include "packet.h"
+#include "renderer.h"
+#include "scheduler.h"
+#include "trace.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+const float AMBIENT_INTENSITY = 1.0f;
+Envmap envmap;
+
+float clamp(float n, float lower, float upper) {
+    return std::max(lower, std::min(n, upper));
+}
+
+Vec3f reflect(const Vec3f& I, const Vec3f& N) {
+    return I - N * 2.f * (I * N);
+}
+
+Vec3f refract(const Vec3f& I, const Vec3f& N, const float& ior)
+{
+    float cosi = clamp(I*N, -1, 1);
+    float etai = 1, etat = ior;
+    Vec3f n = N;
+    if (cosi < 0) { cosi = -cosi; }
+    else { std::swap(etai, etat); n = -N; }
+    float eta = etai / etat;
+    //k is used to check if critical angle of refraction, where we only have a reflection
+    float k = 1 - eta * eta * (1 - cosi * cosi);
+    return k < 0 ? Vec3f(0, 0, 0) : I * eta + (eta * cosi - sqrtf(k)) * n;
+}
+
+void fresnel(const Vec3f& I, const Vec3f& N, const float& ior, float& kr)
+{
+    float cosi = clamp(-1, 1, I*N);
+    float etai = 1, etat = ior;
+    if (cosi > 0) { std::swap(etai, etat); }
+    // Compute sini using Snell's law
+    float sint = etai / etat * sqrtf(std::max(0.f, 1 - cosi * cosi));
+    // Total internal reflection
+    if (sint >= 1) {
+        kr = 1;
+    }
+    else {
+        float cost = sqrtf(std::max(0.f, 1 - sint * sint));
+        cosi = fabsf(cosi);
+        float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
+        float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
+        kr = (Rs * Rs + Rp * Rp) / 2;
+    }
+    // As a consequence of the conservation of energy, the transmittance is given by:
+    // kt = 1 - kr;
+}
+
+
+
+Vec3f sample_envmap(const Vec3f& ro, const Vec3f& rd) {
+    return envmap.sample(rd);
+}
+
+
+// Closest sphere of one BVH leaf, ind is the sphere's index in the scene and hit its slot in the SoA arrays.
+// Ties go to the lowest index, like a linear scan over the spheres would.
+static inline void intersect_sphere_leaf(const Scene& scene, const SphereKernels& kernels, uint32_t first, uint32_t count,
+    const Vec3f& ro, const Vec3f& rd, float& t_max, int& ind, int& hit) {
+    RT_COUNT(sphere_tests, count);
+    float intersection;
+    int k = kernels.closest(scene.sphere_soa, first, count, ro, rd, intersection);
+    if (k < 0) return;
+    int i = scene.bvh.prim_indices[k];
+    if (intersection < t_max || (intersection == t_max && i < ind)) {
+        ind = i;
+        hit = k;
+        t_max = intersection;
+    }
+}
+
+// The part of scene_intersect after the sphere BVH: meshes and the plane. closest_intersection and sphere,
+// a slot of scene.sphere_soa or -1, come from the sphere traversal.
+static bool resolve_hit(const Vec3f& ro, const Vec3f& rd, const Scene& scene, float closest_intersection, int sphere, HitRecord& hit) {
+    // Meshes only report hits closer than everything found so far
+    int mesh_ind = -1;
+    uint32_t triangle = 0;
+    float u = 0, v = 0;
+    for (size_t m = 0; m < scene.meshes.size(); m++) {
+        if (scene.meshes[m].intersect(ro, rd, closest_intersection, triangle, u, v)) mesh_ind = m;
+    }
+
+
+    //Check intersection with plane
+    if (fabs(rd.y) > 1e-3) {
+        float dist = -(ro.y + 4) / rd.y; // the checkerboard plane has equation y = -4
+        Vec3f pt = ro + rd * dist;
+        if (dist > 0 && fabs(pt.x) < 10 && pt.z<-10 && pt.z>-30 && dist < closest_intersection) {
+            hit = { dist, 0, HitRecord::PLANE, pt.x, pt.z };
+            return true;
+        }
+    }
+    if (mesh_ind >= 0) {
+        hit = { closest_intersection, triangle, mesh_ind, u, v };
+        return true;
+    }
+    if (sphere < 0) return false;
+    hit = { closest_intersection, uint32_t(sphere), HitRecord::SPHERE, 0.f, 0.f };
+    return true;
+}
+
+bool scene_intersect(const Vec3f& ro, const Vec3f& rd, const Scene& scene, HitRecord& hit) {
+    float closest_intersection = std::numeric_limits<float>::max();
+    int ind = -1, sphere = -1;
+    const SphereKernels& kernels = active_sphere_kernels();
+    scene.bvh.traverse(ro, rd, closest_intersection, [&](uint32_t first, uint32_t count, float& t_max) {
+        intersect_sphere_leaf(scene, kernels, first, count, ro, rd, t_max, ind, sphere);
+    });
+    return resolve_hit(ro, rd, scene, closest_intersection, sphere, hit);
+}
+
+uint32_t hit_material(const Scene& scene, const HitRecord& hit) {
+    if (hit.mesh == HitRecord::SPHERE) return scene.sphere_material[hit.prim];
+    if (hit.mesh == HitRecord::PLANE) return (int(.5 * hit.u + 1000) + int(.5 * hit.v)) & 1 ? CHECKER_ODD_MATERIAL : CHECKER_EVEN_MATERIAL;
+    return scene.meshes[hit.mesh].material;
+}
+
+Vec3f hit_normal(const Vec3f& ro, const Vec3f& rd, const Scene& scene, const HitRecord& hit) {
+    if (hit.mesh == HitRecord::SPHERE) {
+        const SphereSoA& soa = scene.sphere_soa;
+        return (ro + rd * hit.t - Vec3f(soa.center_x[hit.prim], soa.center_y[hit.prim], soa.center_z[hit.prim])).normalize();
+    }
+    if (hit.mesh == HitRecord::PLANE) return Vec3f(0., 1., 0.);
+    const TriangleMesh& mesh = scene.meshes[hit.mesh];
+    Vec3f normal = mesh.normal(hit.prim);
+    // Opaque meshes are shaded from both sides. Refractive ones keep the winding, which tells inside from outside.
+    if (scene.materials[mesh.material].refractivity == 0.f && normal * rd > 0) normal = -normal;
+    return normal;
+}
+
+// Shadow ray query: is anything hit in (0, max_dist)? Stops at the first blocker and skips all shading work.
+bool scene_occluded(const Vec3f& ro, const Vec3f& rd, const Scene& scene, float max_dist) {
+    if (fabs(rd.y) > 1e-3) {
+        float dist = -(ro.y + 4) / rd.y; // the checkerboard plane has equation y = -4
+        Vec3f pt = ro + rd * dist;
+        if (dist > 0 && fabs(pt.x) < 10 && pt.z<-10 && pt.z>-30 && dist < max_dist) return true;
+    }
+    for (const TriangleMesh& mesh : scene.meshes) {
+        if (mesh.occluded(ro, rd, max_dist)) return true;
+    }
+    const SphereKernels& kernels = active_sphere_kernels();
+    return scene.bvh.occluded(ro, rd, max_dist, [&](uint32_t first, uint32_t count) {
+        RT_COUNT(sphere_tests, count);
+        return kernels.occluded(scene.sphere_soa, first, count, ro, rd, max_dist);
+    });
+}
+
+// A ray waiting to be traced. weight is the factor its color gets scaled by on its way up to the pixel.
+struct RayTask {
+    Vec3f ro, rd;
+    float weight;
+    int depth;
+};
+
+// Fixed capacity stack of pending rays. Every shaded ray pops itself and pushes at most a reflection and a
+// refraction ray, so tracing to depth d never holds more than d + 2 rays.
+struct RayStack {
+    static const int CAPACITY = 64;
+    RayTask items[CAPACITY];
+    int size = 0;
+
+    bool empty() const { return size == 0; }
+    void push(const RayTask& ray) {
+        assert(size < CAPACITY);
+        items[size++] = ray;
+    }
+    RayTask pop() { return items[--size]; }
+};
+
+static_assert(MAX_TRACE_DEPTH + 2 <= RayStack::CAPACITY, "the ray stack can not hold a full trace tree");
+
+// Ray from just above the hit towards the light. Its direction is also the light vector of the Phong terms.
+struct ShadowRay {
+    Vec3f ro, rd;
+    float max_dist;
+};
+
+static ShadowRay shadow_ray(const Light& light, Vec3f hit, const Vec3f& normal) {
+    Vec3f to_light = (light.position - hit).normalize();
+    Vec3f shadow_orig = hit + normal * 1e-3;
+    float light_distance = (light.position - hit).norm();
+    return { shadow_orig, to_light, light_distance };
+}
+
+// Adds the diffuse and specular terms of a light that reaches the hit
+static void add_light(const Light& light, const Vec3f& to_light, const Vec3f& normal, const Vec3f& rd, float shininess,
+    float& diffuse_light_intensity, float& specular_light_intensity) {
+    diffuse_light_intensity += light.intensity * std::max(0.f, to_light * normal);
+
+    Vec3f half_way = (to_light - rd).normalize();
+    specular_light_intensity += powf(std::max(0.f, normal * half_way), shininess) * light.intensity;
+}
+
+static Vec3f local_color(const Material& mat, float diffuse_light_intensity, float specular_light_intensity, float weight) {
+    Vec3f diffuse = mat.color * mat.diffuse * diffuse_light_intensity;
+    Vec3f specular = mat.color * mat.specular * specular_light_intensity;
+    return (diffuse + specular) * weight;
+}
+
+// Writes the refraction and reflection rays of a hit worth tracing to secondary, in that order, and returns their count
+static int secondary_rays(const RayTask& ray, const Material& mat, const Vec3f& hit, const Vec3f& normal, const RenderOptions& options, RayTask secondary[2]) {
+    int count = 0;
+    float kr = 1.0;
+    if (mat.refractivity > 0. && mat.reflectivity > 0.)
+        fresnel(ray.rd, normal, mat.ior, kr);
+    // Skip secondary rays that could not visibly change the pixel, e.g. every reflection off a non-reflective material
+    float reflect_weight = ray.weight * mat.reflectivity * kr;
+    float refract_weight = ray.weight * mat.refractivity * (1 - kr);
+
+    Vec3f reflect_dir = reflect(ray.rd, normal).normalize();
+    if (mat.refractivity > 0.0 && refract_weight > options.min_weight) {
+        Vec3f refracted = refract(ray.rd, normal, 1.333);
+        if (!(refracted.x == 0.0 && refracted.y == 0.0 && refracted.z == 0.0)) {
+            Vec3f refract_dir = refracted.normalize();
+            // Similar to reflect orig but opposite, since we want to go through the object
+            Vec3f refract_orig = reflect_dir * normal < 0 ? hit + normal * 1e-3 : hit - normal * 1e-3;
+            secondary[count++] = { refract_orig, refract_dir, refract_weight, ray.depth + 1 };
+            RT_COUNT(refraction_rays, 1);
+        }
+    }
+    if (reflect_weight > options.min_weight) {
+        Vec3f reflect_orig = reflect_dir * normal < 0 ? hit - normal * 1e-3 : hit + normal * 1e-3; // offset the original point to avoid occlusion by the object itself
+        secondary[count++] = { reflect_orig, reflect_dir, reflect_weight, ray.depth + 1 };
+        RT_COUNT(reflection_rays, 1);
+    }
+    return count;
+}
+
+// Adds the local shading of one ray to color and pushes the reflection and refraction rays it spawns.
+// found and record are the result of scene_intersect for the ray.
+static void shade_ray(const RayTask& ray, bool found, const HitRecord& record, const Scene& scene,
+    const std::vector<Light>& lights, const RenderOptions& options, RayStack& stack, Vec3f& color) {
+    if (!found) {
+        color += sample_envmap(ray.ro, ray.rd) * ray.weight;
+        return;
+    }
+    const Material& mat = scene.materials[hit_material(scene, record)];
+    const Vec3f normal = hit_normal(ray.ro, ray.rd, scene, record);
+    Vec3f hit = ray.ro + ray.rd * record.t;
+
+    float diffuse_light_intensity = 0.f;
+    float specular_light_intensity = 0.f;
+    for (const Light& light : lights) {
+        const ShadowRay shadow = shadow_ray(light, hit, normal);
+        RT_COUNT(shadow_rays, 1);
+        if (scene_occluded(shadow.ro, shadow.rd, scene, shadow.max_dist))
+            continue;
+        add_light(light, shadow.rd, normal, ray.rd, mat.shininess, diffuse_light_intensity, specular_light_intensity);
+    }
+    color += local_color(mat, diffuse_light_intensity, specular_light_intensity, ray.weight);
+
+    // Refraction is pushed first so the reflection subtree is traced first, like the recursive version did
+    RayTask secondary[2];
+    int count = secondary_rays(ray, mat, hit, normal, options, secondary);
+    for (int k = 0; k < count; k++) stack.push(secondary[k]);
+}
+
+// Iterative integrator: walks the reflection/refraction tree depth first from an explicit stack and adds
+// every node's local shading, scaled by its weight, straight into the pixel color.
+static void trace_stack(RayStack& stack, const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options, Vec3f& color) {
+    while (!stack.empty()) {
+        const RayTask ray = stack.pop();
+        RT_COUNT(primary_rays, ray.depth == 0);
+        HitRecord hit;
+        bool found = ray.depth <= options.max_depth && scene_intersect(ray.ro, ray.rd, scene, hit);
+        shade_ray(ray, found, hit, scene, lights, options, stack, color);
+    }
+}
+
+Vec3f cast_ray(const Vec3f& ro, const Vec3f& rd, const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options) {
+    RayStack stack;
+    stack.push({ ro, rd, 1.f, 0 });
+    Vec3f final_color(0., 0., 0.);
+    trace_stack(stack, scene, lights, options, final_color);
+    return final_color;
+}
+
+void trace_shading_points(const Vec3f& ro, const Vec3f& rd, const Scene& scene, const RenderOptions& options, std::vector<ShadingPoint>& points) {
+    // The same walk as trace_stack, with the shading left for later
+    RayStack stack;
+    stack.push({ ro, rd, 1.f, 0 });
+    while (!stack.empty()) {
+        const RayTask ray = stack.pop();
+        HitRecord record;
+        if (ray.depth > options.max_depth || !scene_intersect(ray.ro, ray.rd, scene, record)) {
+            points.push_back({ sample_envmap(ray.ro, ray.rd) * ray.weight, Vec3f(0., 0., 0.), ray.rd, ray.weight, ShadingPoint::ENVIRONMENT });
+            continue;
+        }
+        const uint32_t material = hit_material(scene, record);
+        const Vec3f normal = hit_normal(ray.ro, ray.rd, scene, record);
+        const Vec3f hit = ray.ro + ray.rd * record.t;
+        points.push_back({ hit, normal, ray.rd, ray.weight, material });
+
+        RayTask secondary[2];
+        int count = secondary_rays(ray, scene.materials[material], hit, normal, options, secondary);
+        for (int k = 0; k < count; k++) stack.push(secondary[k]);
+    }
+}
+
+void light_factors(const ShadingPoint& point, const Light& light, const Scene& scene, float& diffuse, float& specular) {
+    diffuse = specular = 0.f;
+    const ShadowRay shadow = shadow_ray(light, point.position, point.normal);
+    RT_COUNT(shadow_rays, 1);
+    if (scene_occluded(shadow.ro, shadow.rd, scene, shadow.max_dist)) return;
+    // add_light with an intensity of 1, scaling afterwards gives the same floats
+    diffuse = std::max(0.f, shadow.rd * point.normal);
+    specular = powf(std::max(0.f, point.normal * (shadow.rd - point.rd).normalize()), scene.materials[point.material].shininess);
+}
+
+Vec3f shade_point(const ShadingPoint& point, const Scene& scene, float diffuse_light_intensity, float specular_light_intensity) {
+    if (point.material == ShadingPoint::ENVIRONMENT) return point.position;
+    return local_color(scene.materials[point.material], diffuse_light_intensity, specular_light_intensity, point.weight);
+}
+
+// Only the sphere BVH is traversed by the whole packet. Meshes, the plane and the shading of every hit run per ray
+// through the same code as cast_ray, so both paths render the same image.
+void cast_packet(const RayPacket& packet, const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options, Vec3f* colors) {
+    float closest[RayPacket::MAX_SIZE];
+    int ind[RayPacket::MAX_SIZE], hit[RayPacket::MAX_SIZE];
+    for (int r = 0; r < packet.size; r++) {
+        closest[r] = std::numeric_limits<float>::max();
+        ind[r] = hit[r] = -1;
+    }
+    RT_COUNT(primary_rays, packet.size);
+    const SphereKernels& kernels = active_sphere_kernels();
+    traverse_packet(scene.bvh, packet, closest, [&](uint32_t first, uint32_t count, int r, float& t_max) {
+        intersect_sphere_leaf(scene, kernels, first, count, packet.ro, packet.rd[r], t_max, ind[r], hit[r]);
+    });
+
+    for (int r = 0; r < packet.size; r++) {
+        RayStack stack;
+        HitRecord record;
+        const RayTask ray = { packet.ro, packet.rd[r], 1.f, 0 };
+        bool found = resolve_hit(ray.ro, ray.rd, scene, closest[r], hit[r], record);
+        colors[r] = Vec3f(0., 0., 0.);
+        shade_ray(ray, found, record, scene, lights, options, stack, colors[r]);
+        trace_stack(stack, scene, lights, options, colors[r]);
+    }
+}
+
+// Wavefront integrator: instead of following one pixel's trace tree at a time, every bounce of a whole tile is
+// traced as one queue. The queue is intersected in one go, the hits are shaded material by material with their
+// shadow rays traced as another queue, and the secondary rays they spawn are sorted into the next queue so rays
+// leaving the same region in the same direction are traced one after the other.
+struct WavefrontRay {
+    RayTask task;
+    uint32_t pixel;
+    uint64_t key;
+};
+
+struct WavefrontHit {
+    uint32_t ray;
+    uint32_t material;
+    HitRecord record;
+    // Computed when its shadow rays are set up
+    Vec3f normal;
+};
+
+// Per worker, reused from tile to tile
+struct WavefrontQueues {
+    std::vector<WavefrontRay> rays, next;
+    std::vector<WavefrontHit> hits;
+    std::vector<ShadowRay> shadows;
+    std::vector<char> occluded;
+    std::vector<Vec3f> colors;
+};
+
+// Everything rays can hit, secondary ray origins are binned on a grid over it
+static AABB scene_bounds(const Scene& scene) {
+    AABB bounds(Vec3f(-10, -4, -30), Vec3f(10, -4, -10)); // the checkerboard
+    if (!scene.bvh.nodes.empty()) bounds.expand(scene.bvh.nodes[0].bounds);
+    for (const TriangleMesh& mesh : scene.meshes) {
+        if (!mesh.bvh.nodes.empty()) bounds.expand(mesh.bvh.nodes[0].bounds);
+    }
+    return bounds;
+}
+
+// Spreads the low 10 bits of v so two zero bits follow each of them
+static uint64_t spread_bits(uint32_t v) {
+    uint64_t x = v & 0x3ff;
+    x = (x | (x << 16)) & 0x30000ff;
+    x = (x | (x << 8)) & 0x300f00f;
+    x = (x | (x << 4)) & 0x30c30c3;
+    x = (x | (x << 2)) & 0x9249249;
+    return x;
+}
+
+// Direction octant in the top bits, then the Morton code of the origin's cell in a 1024^3 grid over bounds
+static uint64_t ray_sort_key(const RayTask& ray, const AABB& bounds) {
+    const uint64_t octant = (ray.rd.x < 0) | (ray.rd.y < 0) << 1 | (ray.rd.z < 0) << 2;
+    uint32_t cell[3];
+    for (int axis = 0; axis < 3; axis++) {
+        const float extent = bounds.max[axis] - bounds.min[axis];
+        const float f = extent > 0 ? (ray.ro[axis] - bounds.min[axis]) / extent : 0.f;
+        cell[axis] = uint32_t(std::min(1023.f, std::max(0.f, f * 1024.f)));
+    }
+    return octant << 30 | spread_bits(cell[0]) | spread_bits(cell[1]) << 1 | spread_bits(cell[2]) << 2;
+}
+
+// Traces queues.rays, which hold the camera rays of a tile, and adds every ray's contribution to colors[pixel]
+static void trace_wavefront(WavefrontQueues& queues, const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options,
+    const AABB& bounds, Vec3f* colors) {
+    while (!queues.rays.empty()) {
+        // Intersection of the whole queue. Misses, and rays past max_depth, take the environment right away.
+        queues.hits.clear();
+        for (uint32_t r = 0; r < queues.rays.size(); r++) {
+            const RayTask& ray = queues.rays[r].task;
+            RT_COUNT(primary_rays, ray.depth == 0);
+            WavefrontHit hit;
+            hit.ray = r;
+            if (ray.depth <= options.max_depth && scene_intersect(ray.ro, ray.rd, scene, hit.record)) {
+                hit.material = hit_material(scene, hit.record);
+                queues.hits.push_back(hit);
+            }
+            else {
+                colors[queues.rays[r].pixel] += sample_envmap(ray.ro, ray.rd) * ray.weight;
+            }
+        }
+        std::stable_sort(queues.hits.begin(), queues.hits.end(), [](const WavefrontHit& a, const WavefrontHit& b) {
+            return a.material < b.material;
+        });
+
+        // Shadow rays of every hit and light, traced as one more queue
+        queues.shadows.clear();
+        for (WavefrontHit& hit : queues.hits) {
+            const RayTask& ray = queues.rays[hit.ray].task;
+            hit.normal = hit_normal(ray.ro, ray.rd, scene, hit.record);
+            Vec3f point = ray.ro + ray.rd * hit.record.t;
+            for (const Light& light : lights) queues.shadows.push_back(shadow_ray(light, point, hit.normal));
+        }
+        RT_COUNT(shadow_rays, queues.shadows.size());
+        queues.occluded.resize(queues.shadows.size());
+        for (size_t k = 0; k < queues.shadows.size(); k++) {
+            const ShadowRay& shadow = queues.shadows[k];
+            queues.occluded[k] = scene_occluded(shadow.ro, shadow.rd, scene, shadow.max_dist);
+        }
+
+        // Shading, batched by material since the hits are sorted by it
+        queues.next.clear();
+        for (size_t h = 0; h < queues.hits.size(); h++) {
+            const WavefrontHit& hit = queues.hits[h];
+            const WavefrontRay& ray = queues.rays[hit.ray];
+            const Material& mat = scene.materials[hit.material];
+            float diffuse_light_intensity = 0.f;
+            float specular_light_intensity = 0.f;
+            for (size_t l = 0; l < lights.size(); l++) {
+                const size_t k = h * lights.size() + l;
+                if (queues.occluded[k]) continue;
+                add_light(lights[l], queues.shadows[k].rd, hit.normal, ray.task.rd, mat.shininess, diffuse_light_intensity, specular_light_intensity);
+            }
+            colors[ray.pixel] += local_color(mat, diffuse_light_intensity, specular_light_intensity, ray.task.weight);
+
+            RayTask secondary[2];
+            int count = secondary_rays(ray.task, mat, ray.task.ro + ray.task.rd * hit.record.t, hit.normal, options, secondary);
+            for (int k = 0; k < count; k++) queues.next.push_back({ secondary[k], ray.pixel, ray_sort_key(secondary[k], bounds) });
+        }
+        std::sort(queues.next.begin(), queues.next.end(), [](const WavefrontRay& a, const WavefrontRay& b) {
+            return a.key < b.key;
+        });
+        queues.rays.swap(queues.next);
+    }
+}
+
+// Adaptive supersampling. Sample s of a pixel lies in stratum stratum(s) of a grid of 2^levels x 2^levels
+// strata, jittered inside it. The low bits of s pick the coarse quadrant, so any 4^k samples in a row starting at a
+// multiple of 4^k cover the pixel evenly, and every batch of 4 puts one sample in each quadrant.
+static void stratum(int s, int levels, int& x, int& y) {
+    x = y = 0;
+    for (int l = 0; l < levels; l++, s >>= 2) {
+        x = (x << 1) | (s & 1);
+        y = (y << 1) | ((s >> 1) & 1);
+    }
+}
+
+// Uniform in [0, 1), a hash of the pixel and the sample so the image does not depend on the tile order
+static float sample_jitter(uint32_t pixel, uint32_t sample, uint32_t dimension) {
+    uint32_t h = pixel * 0x9E3779B1u ^ (2 * sample + dimension) * 0x85EBCA77u;
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    h *= 0x846CA68Bu;
+    h ^= h >> 16;
+    return (h >> 8) * (1.f / 16777216.f);
+}
+
+// Running sums of the samples of one pixel. Samples are clamped to [0, 1] like to_pixel does, so a bright
+// highlight counts as white instead of swamping the mean.
+struct PixelSamples {
+    Vec3f sum, sum_sq;
+    int count;
+
+    void add(const Vec3f& c) {
+        const Vec3f clamped(std::min(1.f, c.x), std::min(1.f, c.y), std::min(1.f, c.z));
+        sum = sum + clamped;
+        sum_sq = sum_sq + Vec3f(clamped.x * clamped.x, clamped.y * clamped.y, clamped.z * clamped.z);
+        count++;
+    }
+    // Whether the variance of the mean is at most max_error^2 in every channel
+    bool converged(float max_error) const {
+        const Vec3f mean = sum * (1.f / count);
+        const float limit = max_error * max_error * count * (count - 1);
+        return sum_sq.x - sum.x * mean.x <= limit && sum_sq.y - sum.y * mean.y <= limit && sum_sq.z - sum.z * mean.z <= limit;
+    }
+};
+
+// Charges what the scope counted to the pixels [x0, x1) x [y0, y1) of a width wide image, in equal parts
+static inline void charge_pixels(RayCounters* pixels, int width, size_t x0, size_t y0, size_t x1, size_t y1, const CounterScope& scope) {
+    if (!COUNTERS_ENABLED || !pixels) return;
+    const RayCounters total = scope.elapsed();
+    const uint64_t n = (x1 - x0) * (y1 - y0);
+    uint64_t k = 0;
+    for (size_t j = y0; j < y1; j++) {
+        for (size_t i = x0; i < x1; i++) pixels[i + j * width] += total.split(n, k++);
+    }
+}
+
+static void render_tile_adaptive(const Tile& tile, const Camera& camera, const Scene& scene, const std::vector<Light>& lights,
+    const RenderOptions& options, std::vector<PixelSamples>& pixels, std::vector<Vec3uc>& framebuffer, RenderStats& stats,
+    RayCounters* pixel_counters) {
+    int levels = 0;
+    while ((1 << (2 * levels)) < options.samples) levels++;
+    const float stratum_size = 1.f / (1 << levels);
+    auto sample_direction = [&](int i, int j, int s) {
+        const uint32_t pixel = uint32_t(i + j * camera.width);
+        int sx, sy;
+        stratum(s, levels, sx, sy);
+        return camera.direction(i + (sx + sample_jitter(pixel, s, 0)) * stratum_size, j + (sy + sample_jitter(pixel, s, 1)) * stratum_size);
+    };
+    const int tile_width = tile.x1 - tile.x0;
+    pixels.assign(tile_width * (tile.y1 - tile.y0), PixelSamples{ Vec3f(0., 0., 0.), Vec3f(0., 0., 0.), 0 });
+
+    // Every pixel gets the first batch. Jittered samples stay inside their pixel, so the packet frustum
+    // along the block's outer pixel edges still holds all of them.
+    RayPacket packet;
+    packet.ro = camera.origin;
+    Vec3f colors[RayPacket::MAX_SIZE];
+    for (int y0 = tile.y0; y0 < tile.y1; y0 += PACKET_DIM) {
+        for (int x0 = tile.x0; x0 < tile.x1; x0 += PACKET_DIM) {
+            const int x1 = std::min(x0 + PACKET_DIM, tile.x1), y1 = std::min(y0 + PACKET_DIM, tile.y1);
+            const CounterScope scope;
+            const Vec3f corners[4] = { camera.direction(x0, y0), camera.direction(x1, y0), camera.direction(x1, y1), camera.direction(x0, y1) };
+            packet.set_frustum(corners);
+            for (int s = 0; s < SAMPLE_BATCH; s++) {
+                packet.size = 0;
+                for (int j = y0; j < y1; j++) {
+                    for (int i = x0; i < x1; i++) packet.push_back(sample_direction(i, j, s));
+                }
+                if (options.packets) cast_packet(packet, scene, lights, options, colors);
+                else {
+                    for (int r = 0; r < packet.size; r++) colors[r] = cast_ray(packet.ro, packet.rd[r], scene, lights, options);
+                }
+                int r = 0;
+                for (int j = y0; j < y1; j++) {
+                    for (int i = x0; i < x1; i++) pixels[i - tile.x0 + (j - tile.y0) * tile_width].add(colors[r++]);
+                }
+            }
+            charge_pixels(pixel_counters, camera.width, x0, y0, x1, y1, scope);
+        }
+    }
+
+    // Only pixels whose samples disagree, edges and highlights mostly, are refined further
+    for (int j = tile.y0; j < tile.y1; j++) {
+        for (int i = tile.x0; i < tile.x1; i++) {
+            PixelSamples& p = pixels[i - tile.x0 + (j - tile.y0) * tile_width];
+            const CounterScope scope;
+            while (p.count < options.samples && !p.converged(options.sample_error)) {
+                const int first = p.count;
+                for (int s = first; s < first + SAMPLE_BATCH; s++) p.add(cast_ray(camera.origin, sample_direction(i, j, s), scene, lights, options));
+            }
+            charge_pixels(pixel_counters, camera.width, i, j, i + 1, j + 1, scope);
+            framebuffer[i + j * camera.width] = to_pixel(p.sum * (1.f / p.count));
+            stats.samples += p.count;
+            if (p.count == SAMPLE_BATCH) stats.converged_early++;
+            if (p.count == options.samples) stats.hit_limit++;
+        }
+    }
+    stats.pixels += pixels.size();
+}
+
+Camera::Camera(const RenderOptions& options) : origin(options.camera_origin), width(options.width), height(options.height) {
+    const float screen_cam_dist = 1.0f;
+    const float fov = options.fov * M_PI / 180.f; //in radians
+    aspect = width / (float)height;
+    //https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-generating-camera-rays/generating-camera-rays.html
+    // In double, the float tan of some math libraries is an ulp off the correctly rounded value
+    screen_width = float(tan(fov / 2.0)) * screen_cam_dist;
+}
+
+Vec3f Camera::direction(float x, float y) const {
+    float rx = (2 * x / (float)width - 1) * screen_width * aspect;
+    float ry = (1 - 2 * y / (float)height) * screen_width;
+    return Vec3f(rx, ry, -1.f).normalize();
+}
+
+Vec3uc to_pixel(const Vec3f& color) {
+    return Vec3uc(
+        int(std::min(1.f, color.x) * 255),
+        int(std::min(1.f, color.y) * 255),
+        int(std::min(1.f, color.z) * 255));
+}
+
+std::vector<Vec3uc> render(const Scene& scene, const std::vector<Light>& lights, const RenderOptions& options, RenderStats* stats) {
+    TraceSpan span("frame");
+    const int width = options.width;
+    const int height = options.height;
+    const Camera camera(options);
+    const Vec3f origin = camera.origin;
+
+    std::vector<Vec3uc> framebuffer(width * height);
+    const AABB bounds = scene_bounds(scene);
+    std::vector<WavefrontQueues> wavefront(options.integrator == Integrator::Wavefront ? options.threads : 0);
+    const bool adaptive = options.samples > 1;
+    std::vector<std::vector<PixelSamples>> samples(adaptive ? options.threads : 0);
+    std::vector<RenderStats> worker_stats(options.threads);
+    RayCounters* pixel_counters = nullptr;
+    if (stats) {
+        stats->pixel_counters.clear();
+        if (COUNTERS_ENABLED) {
+            stats->pixel_counters.resize(framebuffer.size());
+            pixel_counters = stats->pixel_counters.data();
+        }
+    }
+
+    // Pixels only depend on (i, j), so the image is the same whatever order the tiles are rendered in
+    const std::vector<Tile> tiles = make_tiles(width, height, options.tile_size);
+    parallel_for_stealing(tiles.size(), options.threads, [&](int worker, int t) {
+        const Tile& tile = tiles[t];
+        TraceSpan span("tile");
+        span.arg("x", tile.x0);
+        span.arg("y", tile.y0);
+        if (adaptive) return render_tile_adaptive(tile, camera, scene, lights, options, samples[worker], framebuffer, worker_stats[worker], pixel_counters);
+        worker_stats[worker].pixels += (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+        if (options.integrator == Integrator::Wavefront) {
+            const CounterScope scope;
+            WavefrontQueues& queues = wavefront[worker];
+            const int tile_width = tile.x1 - tile.x0;
+            queues.rays.clear();
+            queues.colors.assign(tile_width * (tile.y1 - tile.y0), Vec3f(0., 0., 0.));
+            for (int j = tile.y0; j < tile.y1; j++) {
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    const RayTask ray = { origin, camera.direction(i + 0.5f, j + 0.5f), 1.f, 0 };
+                    queues.rays.push_back({ ray, uint32_t(i - tile.x0 + (j - tile.y0) * tile_width), 0 });
+                }
+            }
+            trace_wavefront(queues, scene, lights, options, bounds, queues.colors.data());
+            for (int j = tile.y0; j < tile.y1; j++) {
+                for (int i = tile.x0; i < tile.x1; i++) framebuffer[i + j * width] = to_pixel(queues.colors[i - tile.x0 + (j - tile.y0) * tile_width]);
+            }
+            charge_pixels(pixel_counters, width, tile.x0, tile.y0, tile.x1, tile.y1, scope);
+            return;
+        }
+        if (!options.packets) {
+            for (int j = tile.y0; j < tile.y1; j++) {
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    const CounterScope scope;
+                    framebuffer[i + j * width] = to_pixel(cast_ray(origin, camera.direction(i + 0.5f, j + 0.5f), scene, lights, options));
+                    charge_pixels(pixel_counters, width, i, j, i + 1, j + 1, scope);
+                }
+            }
+            return;
+        }
+        // Packets of up to PACKET_DIM x PACKET_DIM pixels, the frustum runs along the block's outer pixel edges
+        RayPacket packet;
+        packet.ro = origin;
+        Vec3f colors[RayPacket::MAX_SIZE];
+        for (int y0 = tile.y0; y0 < tile.y1; y0 += PACKET_DIM) {
+            for (int x0 = tile.x0; x0 < tile.x1; x0 += PACKET_DIM) {
+                const int x1 = std::min(x0 + PACKET_DIM, tile.x1), y1 = std::min(y0 + PACKET_DIM, tile.y1);
+                const CounterScope scope;
+                packet.size = 0;
+                for (int j = y0; j < y1; j++) {
+                    for (int i = x0; i < x1; i++) packet.push_back(camera.direction(i + 0.5f, j + 0.5f));
+                }
+                const Vec3f corners[4] = { camera.direction(x0, y0), camera.direction(x1, y0), camera.direction(x1, y1), camera.direction(x0, y1) };
+                packet.set_frustum(corners);
+                cast_packet(packet, scene, lights, options, colors);
+                int r = 0;
+                for (int j = y0; j < y1; j++) {
+                    for (int i = x0; i < x1; i++) framebuffer[i + j * width] = to_pixel(colors[r++]);
+                }
+                charge_pixels(pixel_counters, width, x0, y0, x1, y1, scope);
+            }
+        }
+    });
+
+    if (stats) {
+        stats->pixels = stats->samples = stats->converged_early = stats->hit_limit = 0;
+        for (const RenderStats& w : worker_stats) {
+            stats->pixels += w.pixels;
+            stats->samples += adaptive ? w.samples : w.pixels;
+            stats->converged_early += w.converged_early;
+            stats->hit_limit += adaptive ? w.hit_limit : w.pixels;
+        }
+    }
+    return framebuffer;
+}
+
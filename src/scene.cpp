@@ -0,0 +1,103 @@
+#include <cmath>
+#include <random>
+#include "scene.h"
+#include "trace.h"
+
+Scene::Scene() {
+    Material odd, even;
+    odd.color = Vec3f(.3, .3, .3);
+    even.color = Vec3f(.3, .2, .1);
+    add_material(odd);
+    add_material(even);
+}
+
+void Scene::build_bvh() {
+    build_sphere_bvh();
+    for (TriangleMesh& mesh : meshes) mesh.build_bvh();
+}
+
+void Scene::build_sphere_bvh() {
+    TraceSpan span("sphere bvh build", "load");
+    std::vector<AABB> bounds(spheres.size());
+    for (size_t i = 0; i < spheres.size(); i++) {
+        const Vec3f r(spheres[i].radius, spheres[i].radius, spheres[i].radius);
+        bounds[i] = AABB(spheres[i].center - r, spheres[i].center + r);
+    }
+    bvh.build(bounds);
+
+    sphere_soa.clear();
+    sphere_material.clear();
+    for (uint32_t i : bvh.prim_indices) {
+        sphere_soa.push_back(spheres[i].center, spheres[i].radius);
+        sphere_material.push_back(spheres[i].material);
+    }
+    sphere_soa.pad();
+}
+
+float Scene::refit_sphere_bvh() {
+    TraceSpan span("sphere bvh refit");
+    float* x = sphere_soa.center_x.data();
+    float* y = sphere_soa.center_y.data();
+    float* z = sphere_soa.center_z.data();
+    const float* r = sphere_soa.radius.data();
+    const uint32_t* prims = bvh.prim_indices.data();
+    for (size_t k = 0; k < sphere_count(); k++) {
+        const Vec3f& center = spheres[prims[k]].center;
+        x[k] = center.x;
+        y[k] = center.y;
+        z[k] = center.z;
+    }
+    // Leaf ranges index sphere_soa directly
+    bvh.refit([&](uint32_t first, uint32_t count) {
+        AABB bounds;
+        for (uint32_t k = first; k < first + count; k++) {
+            bounds.expand(AABB(Vec3f(x[k] - r[k], y[k] - r[k], z[k] - r[k]), Vec3f(x[k] + r[k], y[k] + r[k], z[k] + r[k])));
+        }
+        return bounds;
+    });
+    return bvh.sah_cost();
+}
+
+void Scene::unpack_spheres() {
+    spheres.assign(sphere_count(), Sphere(Vec3f(0, 0, 0), 0, 0));
+    for (size_t k = 0; k < sphere_count(); k++) {
+        const Vec3f center(sphere_soa.center_x[k], sphere_soa.center_y[k], sphere_soa.center_z[k]);
+        spheres[bvh.prim_indices[k]] = Sphere(center, sphere_soa.radius[k], sphere_material[k]);
+    }
+}
+
+Scene make_demo_scene() {
+    Scene scene;
+    uint32_t      ivory = scene.add_material(Material(Vec3f(0.4, 0.4, 0.3), 0.6, 0.3, 50., 0.1, 0.0, 1.0));
+    uint32_t red_rubber = scene.add_material(Material(Vec3f(0.3, 0.1, 0.1), 0.9, 0.1, 10., 0.0, 0.0, 1.0));
+    uint32_t     mirror = scene.add_material(Material(Vec3f(1.0, 1.0, 1.0), 0.0, 10.0, 1425., 0.8, 0.0, 1.0));
+    uint32_t      glass = scene.add_material(Material(Vec3f(0.6, 0.7, 0.8), 0.0, 0.5, 125., 0.1, 0.8, 1.5));
+
+    scene.spheres.push_back(Sphere(Vec3f(-3, 0, -16), 2, ivory));
+    scene.spheres.push_back(Sphere(Vec3f(-1.0, -1.5, -12), 2, glass));
+    scene.spheres.push_back(Sphere(Vec3f(1.5, -0.5, -18), 3, red_rubber));
+    scene.spheres.push_back(Sphere(Vec3f(7, 5, -18), 4, mirror));
+    return scene;
+}
+
+std::vector<Light> make_demo_lights() {
+    std::vector<Light>  lights;
+    lights.push_back(Light(Vec3f(-20, 20, 20), 1.5));
+    lights.push_back(Light(Vec3f(30, 50, -25), 1.8));
+    lights.push_back(Light(Vec3f(30, 20, 30), 1.7));
+    return lights;
+}
+
+Scene make_random_scene(int count, unsigned seed) {
+    Scene demo = make_demo_scene();
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> x(-12, 12), y(-9, 9), z(-60, -10);
+    std::uniform_int_distribution<size_t> pick(0, demo.spheres.size() - 1);
+    float radius = 6.f / std::cbrt(float(count));
+    Scene scene;
+    scene.materials = demo.materials;
+    for (int i = 0; i < count; i++) {
+        scene.spheres.push_back(Sphere(Vec3f(x(rng), y(rng), z(rng)), radius, demo.spheres[pick(rng)].material));
+    }
+    return scene;
+}
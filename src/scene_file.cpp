@@ -0,0 +1,266 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "scene_file.h"
+#include "trace.h"
+
+namespace {
+
+const char SCENE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '1' };
+const uint32_t SCENE_VERSION = 3;
+const uint32_t SCENE_ENDIAN_TAG = 0x01020304;
+
+// Element range of one array, offset in bytes from the start of the file
+struct SceneSection {
+    uint64_t offset;
+    uint64_t count;
+};
+
+// Little endian like the envmap cache. The struct sizes are stored so a build with a different
+// Material or BVHNode layout refuses the file instead of misreading it.
+struct SceneFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_tag;
+    uint32_t material_size;
+    uint32_t node_size;
+    uint32_t mesh_count;
+    uint32_t reserved;
+    SceneSection materials;
+    // Including the SphereSoA::PADDING dummy spheres
+    SceneSection center_x, center_y, center_z, radius;
+    SceneSection sphere_material;
+    SceneSection nodes, prim_indices;
+    // mesh_count SceneMeshRecords
+    SceneSection meshes;
+    // Hash of this header with the digest zeroed and of every section, written last
+    uint64_t digest_hi, digest_lo;
+};
+
+struct SceneMeshRecord {
+    uint32_t material;
+    uint32_t reserved;
+    SceneSection vertices, indices, nodes, prim_indices;
+};
+
+// Assigns file offsets to arrays in the order they are added and writes them out with the padding in between
+class SectionWriter {
+public:
+    explicit SectionWriter(uint64_t start) : end(start) {}
+
+    template <typename T>
+    SceneSection add(const T* data, size_t count) {
+        SceneSection section = { align_up(end), count };
+        chunks.push_back({ data, section.offset, count * sizeof(T) });
+        end = section.offset + count * sizeof(T);
+        return section;
+    }
+
+    void hash(Hasher& h) const {
+        for (const Chunk& chunk : chunks) h.bytes(chunk.data, size_t(chunk.bytes));
+    }
+
+    bool write(FILE* f, uint64_t position) const {
+        for (const Chunk& chunk : chunks) {
+            if (!write_padding(f, position, chunk.offset)) return false;
+            if (chunk.bytes && fwrite(chunk.data, 1, chunk.bytes, f) != chunk.bytes) return false;
+            position = chunk.offset + chunk.bytes;
+        }
+        return true;
+    }
+
+private:
+    struct Chunk {
+        const void* data;
+        uint64_t offset;
+        uint64_t bytes;
+    };
+    std::vector<Chunk> chunks;
+    uint64_t end;
+};
+
+template <typename T>
+bool section_fits(const SceneSection& section, uint64_t file_size) {
+    return section.offset % FILE_SECTION_ALIGNMENT == 0 && section.offset <= file_size
+        && section.count <= (file_size - section.offset) / sizeof(T);
+}
+
+template <typename T>
+Buffer<T> section_view(const MappedFile& file, const SceneSection& section) {
+    return Buffer<T>::view(reinterpret_cast<const T*>(file.data() + section.offset), size_t(section.count));
+}
+
+// True if every value of a section that fits the file is below limit
+bool indices_below(const MappedFile& file, const SceneSection& section, uint64_t limit) {
+    const uint32_t* values = reinterpret_cast<const uint32_t*>(file.data() + section.offset);
+    for (uint64_t i = 0; i < section.count; i++) {
+        if (values[i] >= limit) return false;
+    }
+    return true;
+}
+
+// Checks that the nodes form a tree like BVH::build writes, so traversal and refits stay inside the arrays and
+// terminate: children come after their parent, every node but the root is the child of exactly one node, the depth
+// fits the traversal stacks and leaves cover a range of prim_indices. One pass over the nodes.
+bool valid_bvh(const MappedFile& file, const SceneSection& nodes_section, uint64_t prim_index_count) {
+    const BVHNode* nodes = reinterpret_cast<const BVHNode*>(file.data() + nodes_section.offset);
+    const uint64_t count = nodes_section.count;
+    // 0 until a parent reaches the node
+    std::vector<uint8_t> depth(size_t(count), 0);
+    if (count > 0) depth[0] = 1;
+    for (uint64_t i = 0; i < count; i++) {
+        const BVHNode& node = nodes[i];
+        if (depth[i] == 0) return false;
+        if (node.is_leaf()) {
+            if (uint64_t(node.left_first) + node.count > prim_index_count) return false;
+            continue;
+        }
+        const uint64_t left = node.left_first;
+        if (left <= i || left + 1 >= count || depth[i] >= BVH::MAX_DEPTH - 1) return false;
+        if (depth[left] != 0 || depth[left + 1] != 0) return false;
+        depth[left] = depth[left + 1] = uint8_t(depth[i] + 1);
+    }
+    return true;
+}
+
+}
+
+bool write_scene(const char* path, const Scene& scene) {
+    std::vector<SceneMeshRecord> records(scene.meshes.size());
+    for (size_t m = 0; m < scene.meshes.size(); m++) {
+        memset(&records[m], 0, sizeof(SceneMeshRecord));
+        records[m].material = scene.meshes[m].material;
+    }
+
+    SceneFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+    header.version = SCENE_VERSION;
+    header.endian_tag = SCENE_ENDIAN_TAG;
+    header.material_size = sizeof(Material);
+    header.node_size = sizeof(BVHNode);
+    header.mesh_count = uint32_t(scene.meshes.size());
+
+    SectionWriter writer(sizeof(header));
+    const SphereSoA& soa = scene.sphere_soa;
+    header.meshes = writer.add(records.data(), records.size());
+    header.materials = writer.add(scene.materials.data(), scene.materials.size());
+    header.center_x = writer.add(soa.center_x.data(), soa.center_x.size());
+    header.center_y = writer.add(soa.center_y.data(), soa.center_y.size());
+    header.center_z = writer.add(soa.center_z.data(), soa.center_z.size());
+    header.radius = writer.add(soa.radius.data(), soa.radius.size());
+    header.sphere_material = writer.add(scene.sphere_material.data(), scene.sphere_material.size());
+    header.nodes = writer.add(scene.bvh.nodes.data(), scene.bvh.nodes.size());
+    header.prim_indices = writer.add(scene.bvh.prim_indices.data(), scene.bvh.prim_indices.size());
+    for (size_t m = 0; m < scene.meshes.size(); m++) {
+        const TriangleMesh& mesh = scene.meshes[m];
+        records[m].vertices = writer.add(mesh.vertices.data(), mesh.vertices.size());
+        records[m].indices = writer.add(mesh.indices.data(), mesh.indices.size());
+        records[m].nodes = writer.add(mesh.bvh.nodes.data(), mesh.bvh.nodes.size());
+        records[m].prim_indices = writer.add(mesh.bvh.prim_indices.data(), mesh.bvh.prim_indices.size());
+    }
+    // The render cache keys mapped scenes with this digest, so it never has to read them
+    Hasher h;
+    h.bytes(&header, sizeof(header));
+    writer.hash(h);
+    const Digest digest = h.digest();
+    header.digest_hi = digest.hi;
+    header.digest_lo = digest.lo;
+
+    // Written next to the file and renamed over it, so a concurrent run never maps a half written scene
+    std::string tmp_path = std::string(path) + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "wb");
+    bool ok = f && fwrite(&header, sizeof(header), 1, f) == 1 && writer.write(f, sizeof(header));
+    if (f) ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+    if (ok) remove(path);
+#endif
+    if (!ok || rename(tmp_path.c_str(), path) != 0) {
+        remove(tmp_path.c_str());
+        std::cerr << "Error: can not write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool map_scene(const char* path, Scene& scene) {
+    TraceSpan span("scene map", "load");
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    if (!file->open(path)) {
+        std::cerr << "Error: can not open " << path << std::endl;
+        return false;
+    }
+    SceneFileHeader header;
+    if (file->size() < sizeof(header)) {
+        std::cerr << "Error: " << path << " is not a scene file" << std::endl;
+        return false;
+    }
+    memcpy(&header, file->data(), sizeof(header));
+    if (memcmp(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC)) || header.endian_tag != SCENE_ENDIAN_TAG) {
+        std::cerr << "Error: " << path << " is not a scene file" << std::endl;
+        return false;
+    }
+    if (header.version != SCENE_VERSION || header.material_size != sizeof(Material) || header.node_size != sizeof(BVHNode)) {
+        std::cerr << "Error: " << path << " was written by an incompatible version" << std::endl;
+        return false;
+    }
+
+    const uint64_t size = file->size();
+    const uint64_t soa_count = header.center_x.count;
+    bool ok = section_fits<SceneMeshRecord>(header.meshes, size) && header.meshes.count == header.mesh_count
+        && section_fits<Material>(header.materials, size) && header.materials.count > CHECKER_EVEN_MATERIAL
+        && section_fits<float>(header.center_x, size) && section_fits<float>(header.center_y, size)
+        && section_fits<float>(header.center_z, size) && section_fits<float>(header.radius, size)
+        && section_fits<uint32_t>(header.sphere_material, size)
+        && section_fits<BVHNode>(header.nodes, size) && section_fits<uint32_t>(header.prim_indices, size)
+        && soa_count >= uint64_t(SphereSoA::PADDING) && header.center_y.count == soa_count
+        && header.center_z.count == soa_count && header.radius.count == soa_count
+        && header.sphere_material.count == soa_count - SphereSoA::PADDING
+        && header.prim_indices.count == header.sphere_material.count
+        && indices_below(*file, header.sphere_material, header.materials.count)
+        && indices_below(*file, header.prim_indices, header.sphere_material.count)
+        && valid_bvh(*file, header.nodes, header.prim_indices.count);
+    std::vector<SceneMeshRecord> records(ok ? header.mesh_count : 0);
+    if (ok && !records.empty()) memcpy(records.data(), file->data() + header.meshes.offset, records.size() * sizeof(SceneMeshRecord));
+    for (const SceneMeshRecord& record : records) {
+        ok = ok && record.material < header.materials.count
+            && section_fits<Vec3f>(record.vertices, size) && section_fits<uint32_t>(record.indices, size)
+            && section_fits<BVHNode>(record.nodes, size) && section_fits<uint32_t>(record.prim_indices, size)
+            && record.indices.count % 3 == 0 && record.prim_indices.count == record.indices.count / 3
+            && indices_below(*file, record.indices, record.vertices.count)
+            && indices_below(*file, record.prim_indices, record.prim_indices.count)
+            && valid_bvh(*file, record.nodes, record.prim_indices.count);
+    }
+    if (!ok) {
+        std::cerr << "Error: " << path << " is truncated or corrupt" << std::endl;
+        return false;
+    }
+
+    Scene loaded;
+    loaded.materials = section_view<Material>(*file, header.materials);
+    loaded.sphere_soa.center_x = section_view<float>(*file, header.center_x);
+    loaded.sphere_soa.center_y = section_view<float>(*file, header.center_y);
+    loaded.sphere_soa.center_z = section_view<float>(*file, header.center_z);
+    loaded.sphere_soa.radius = section_view<float>(*file, header.radius);
+    loaded.sphere_material = section_view<uint32_t>(*file, header.sphere_material);
+    loaded.bvh.nodes = section_view<BVHNode>(*file, header.nodes);
+    loaded.bvh.prim_indices = section_view<uint32_t>(*file, header.prim_indices);
+    loaded.meshes.resize(records.size());
+    for (size_t m = 0; m < records.size(); m++) {
+        TriangleMesh& mesh = loaded.meshes[m];
+        mesh.vertices = section_view<Vec3f>(*file, records[m].vertices);
+        mesh.indices = section_view<uint32_t>(*file, records[m].indices);
+        mesh.bvh.nodes = section_view<BVHNode>(*file, records[m].nodes);
+        mesh.bvh.prim_indices = section_view<uint32_t>(*file, records[m].prim_indices);
+        mesh.material = records[m].material;
+    }
+    loaded.mapping = file;
+    loaded.file_digest.hi = header.digest_hi;
+    loaded.file_digest.lo = header.digest_lo;
+    scene = std::move(loaded);
+    return true;
+}
@@ -0,0 +1,60 @@
+#include <string>
+#include "scheduler.h"
+
+WorkerPool& WorkerPool::instance() {
+    static WorkerPool pool;
+    return pool;
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& t : workers) t.join();
+}
+
+bool WorkerPool::run(int threads, const std::function<void(int)>& job) {
+    // Also catches runs from inside job(0), where try-locking a mutex this thread already holds would be undefined
+    if (busy.exchange(true, std::memory_order_acquire)) return false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Worker ids start at 1, the caller is worker 0
+        while (int(workers.size()) < threads - 1) {
+            const int id = int(workers.size()) + 1;
+            workers.emplace_back([this, id]() { worker(id); });
+        }
+        current = &job;
+        active = threads;
+        pending = threads - 1;
+        generation++;
+    }
+    wake.notify_all();
+    job(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&]() { return pending == 0; });
+    current = nullptr;
+    busy.store(false, std::memory_order_release);
+    return true;
+}
+
+void WorkerPool::worker(int id) {
+    uint64_t seen = 0;
+    for (;;) {
+        const std::function<void(int)>* job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            if (id >= active) continue;
+            job = current;
+        }
+        // Named on every run, tracing may have started since the last one
+        trace_thread_name(("worker " + std::to_string(id)).c_str());
+        (*job)(id);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0) finished.notify_one();
+    }
+}
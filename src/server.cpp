@@ -0,0 +1,599 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "image_writer.h"
+#include "mapped_file.h"
+#include "render_cache.h"
+#include "renderer.h"
+#include "scene_file.h"
+#include "trace.h"
+
+// Long running render server. Clients connect to a Unix domain socket, send one job as text and get the JPEG back
+// on the same connection. The envmap is loaded once, and loaded scenes with their BVHs are kept in an LRU cache, so
+// a job only pays for tracing and encoding when its scene was rendered recently. With --cache, built scenes and
+// finished frames are also kept on disk, and a job identical to an earlier one is answered without tracing.
+//
+// A job is one "key values" line per setting, finished by "end" or by closing the sending side:
+//   priority N          higher runs first, equal priorities in arrival order (default 0)
+//   size W H            image size (default 1024 768)
+//   camera X Y Z        camera position (default 0 0 0), the camera looks down -z
+//   fov DEGREES         vertical field of view (default 60)
+//   samples N           adaptive supersampling, a power of 4 up to 1024 (default 1)
+//   sample-error E      see --sample-error of raytracer (default 0.01)
+//   max-depth N         recursion limit (default 4)
+//   quality Q           JPEG quality (default 100)
+//   scene demo | scene random COUNT SEED | scene file PATH
+//   obj PATH            adds a mesh to a demo or random scene, may be repeated
+//   light X Y Z I       may be repeated, the demo lights when there is none
+// Lines starting with # are ignored, and an empty job renders the defaults. A connection that sends "shutdown"
+// instead stops the server once the queued jobs are done, one that sends "ping" only gets "ok 0\n" back. The reply
+// is "ok BYTES\n" followed by the JPEG, or "error MESSAGE\n".
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct SceneSpec {
+    std::string kind = "demo";
+    int count = 0;
+    unsigned seed = 0;
+    std::string path;
+    std::vector<std::string> objs;
+};
+
+struct Job {
+    int priority = 0;
+    uint64_t sequence = 0;
+    int fd = -1;
+    Clock::time_point queued;
+    RenderOptions options;
+    int quality = 100;
+    SceneSpec scene;
+    std::vector<Light> lights;
+};
+
+struct JobOrder {
+    bool operator()(const Job& a, const Job& b) const {
+        if (a.priority != b.priority) return a.priority < b.priority;
+        return a.sequence > b.sequence;
+    }
+};
+
+bool send_all(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+void send_error(int fd, const std::string& message) {
+    std::string reply = "error " + message + "\n";
+    send_all(fd, reply.data(), reply.size());
+}
+
+void send_image(int fd, const std::vector<unsigned char>& jpeg) {
+    std::string header = "ok " + std::to_string(jpeg.size()) + "\n";
+    if (send_all(fd, header.data(), header.size())) send_all(fd, jpeg.data(), jpeg.size());
+}
+
+// A connection whose request is still arriving. The accept loop polls all of them, so a client sending slowly only
+// holds up itself.
+struct PendingRequest {
+    int fd;
+    Clock::time_point deadline;
+    std::string data;
+    std::vector<std::string> lines;
+};
+
+// Failed: the client sent too much or too slowly. Broken: reading failed, the connection was reset.
+enum class ReadState { More, Done, Failed, Broken };
+
+// Reads what has arrived without blocking and splits it into lines, until "end", "shutdown", "ping" or the end of
+// the stream.
+ReadState read_request(PendingRequest& request) {
+    const size_t max_request = 1 << 16;
+    char buffer[4096];
+    ssize_t n;
+    do {
+        n = recv(request.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? ReadState::More : ReadState::Broken;
+    std::string& data = request.data;
+    data.append(buffer, size_t(n));
+    if (data.size() > max_request) return ReadState::Failed;
+    size_t start = 0, newline;
+    while ((newline = data.find('\n', start)) != std::string::npos) {
+        std::string line = data.substr(start, newline - start);
+        start = newline + 1;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line == "end") return ReadState::Done;
+        request.lines.push_back(line);
+        if (line == "shutdown" || line == "ping") return ReadState::Done;
+    }
+    data.erase(0, start);
+    if (n == 0) {
+        if (!data.empty()) request.lines.push_back(data);
+        return ReadState::Done;
+    }
+    return ReadState::More;
+}
+
+bool parse_job(const std::vector<std::string>& lines, Job& job, std::string& error) {
+    for (const std::string& line : lines) {
+        std::istringstream in(line);
+        std::string key;
+        if (!(in >> key) || key[0] == '#') continue;
+        bool ok = true;
+        if (key == "priority") ok = bool(in >> job.priority);
+        else if (key == "size") ok = in >> job.options.width >> job.options.height && job.options.width > 0 && job.options.height > 0
+            && job.options.width <= 16384 && job.options.height <= 16384;
+        else if (key == "camera") ok = bool(in >> job.options.camera_origin.x >> job.options.camera_origin.y >> job.options.camera_origin.z);
+        else if (key == "fov") ok = in >> job.options.fov && job.options.fov > 0.f && job.options.fov < 180.f;
+        else if (key == "samples") {
+            int& s = job.options.samples;
+            ok = in >> s && s >= 1 && s <= 1024 && !(s & (s - 1)) && !(s & 0xAAAAAAAA);
+        }
+        else if (key == "sample-error") ok = in >> job.options.sample_error && job.options.sample_error >= 0.f;
+        else if (key == "max-depth") ok = in >> job.options.max_depth && job.options.max_depth >= 0 && job.options.max_depth <= MAX_TRACE_DEPTH;
+        else if (key == "quality") ok = in >> job.quality && job.quality >= 1 && job.quality <= 100;
+        else if (key == "scene") {
+            ok = bool(in >> job.scene.kind);
+            if (job.scene.kind == "random") ok = in >> job.scene.count >> job.scene.seed && job.scene.count > 0;
+            else if (job.scene.kind == "file") ok = bool(in >> job.scene.path);
+            else ok = ok && job.scene.kind == "demo";
+        }
+        else if (key == "obj") {
+            std::string path;
+            ok = bool(in >> path);
+            job.scene.objs.push_back(path);
+        }
+        else if (key == "light") {
+            Vec3f position;
+            float intensity;
+            ok = bool(in >> position.x >> position.y >> position.z >> intensity);
+            job.lights.push_back(Light(position, intensity));
+        }
+        else {
+            error = "unknown setting " + key;
+            return false;
+        }
+        if (!ok) {
+            error = "bad value in \"" + line + "\"";
+            return false;
+        }
+    }
+    if (job.scene.kind == "file" && !job.scene.objs.empty()) {
+        error = "meshes of a scene file are added with raytracer_scene --obj";
+        return false;
+    }
+    if (job.lights.empty()) job.lights = make_demo_lights();
+    return true;
+}
+
+struct LoadedScene {
+    std::shared_ptr<const Scene> scene;
+    // Only set with a render cache
+    Digest geometry;
+};
+
+// Recently rendered scenes with their BVHs, only used from the render thread. With a render cache, built scenes
+// are also stored on disk under their geometry hash and mapped from there on the next miss.
+class SceneCache {
+public:
+    SceneCache(size_t capacity, RenderCache* disk) : capacity(capacity), disk(disk) {}
+
+    // Null scene when it can not be loaded, the error has been printed then
+    LoadedScene get(const SceneSpec& spec, bool& hit) {
+        std::string key = cache_key(spec);
+        hit = false;
+        if (key.empty()) return LoadedScene();
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->first != key) continue;
+            entries.splice(entries.begin(), entries, it);
+            hit = true;
+            return entries.front().second;
+        }
+        LoadedScene loaded = load(spec);
+        if (!loaded.scene || capacity == 0) return loaded;
+        entries.emplace_front(key, loaded);
+        if (entries.size() > capacity) entries.pop_back();
+        return loaded;
+    }
+
+private:
+    // Files are keyed with their size and modification time, so edited files are loaded again
+    static std::string cache_key(const SceneSpec& spec) {
+        std::ostringstream key;
+        key << spec.kind;
+        if (spec.kind == "random") key << " " << spec.count << " " << spec.seed;
+        std::vector<std::string> paths = spec.objs;
+        if (spec.kind == "file") paths.insert(paths.begin(), spec.path);
+        for (const std::string& path : paths) {
+            FileStamp stamp;
+            if (!file_stamp(path.c_str(), stamp)) {
+                std::cerr << "Error: can not open " << path << std::endl;
+                return std::string();
+            }
+            key << "\n" << path << " " << stamp.size << " " << stamp.mtime;
+        }
+        return key.str();
+    }
+
+    LoadedScene load(const SceneSpec& spec) {
+        std::shared_ptr<Scene> scene = std::make_shared<Scene>();
+        LoadedScene loaded;
+        if (spec.kind == "file") {
+            if (!map_scene(spec.path.c_str(), *scene)) return loaded;
+            if (disk) loaded.geometry = hash_geometry(*scene);
+            loaded.scene = scene;
+            return loaded;
+        }
+        *scene = spec.kind == "random" ? make_random_scene(spec.count, spec.seed) : make_demo_scene();
+        if (!spec.objs.empty()) {
+            const uint32_t mesh_material = scene->add_material(Material(Vec3f(0.4, 0.4, 0.3), 0.6, 0.3, 50., 0.1, 0.0, 1.0));
+            for (const std::string& path : spec.objs) {
+                TriangleMesh mesh;
+                if (!load_obj(path.c_str(), mesh)) return loaded;
+                mesh.material = mesh_material;
+                scene->meshes.push_back(std::move(mesh));
+            }
+        }
+        if (disk) loaded.geometry = hash_geometry(*scene);
+        if (!disk || !disk->load_scene(loaded.geometry, *scene)) {
+            scene->build_bvh();
+            if (disk) disk->store_scene(loaded.geometry, *scene);
+        }
+        loaded.scene = scene;
+        return loaded;
+    }
+
+    size_t capacity;
+    RenderCache* disk;
+    std::list<std::pair<std::string, LoadedScene>> entries;
+};
+
+std::string describe(const SceneSpec& spec) {
+    std::string s = spec.kind;
+    if (spec.kind == "random") s += " " + std::to_string(spec.count) + " " + std::to_string(spec.seed);
+    if (spec.kind == "file") s += " " + spec.path;
+    for (const std::string& path : spec.objs) s += " + " + path;
+    return s;
+}
+
+class Server {
+public:
+    Server(int threads, int encoders, size_t scene_cache, RenderCache* disk)
+        : threads(threads), writer(encoders, 2 * encoders), scenes(scene_cache, disk), disk(disk) {
+        file_stamp("envmap.jpg", envmap_stamp);
+    }
+
+    // Accepts connections until a shutdown request, then finishes the queued jobs. Requests are read as they arrive,
+    // and every client gets the same time to send its whole request.
+    void serve(int listen_fd) {
+        const std::chrono::seconds request_time(5);
+        std::thread renderer([this]() {
+            trace_thread_name("render");
+            render_jobs();
+        });
+        std::vector<PendingRequest> pending;
+        bool shutdown = false;
+        while (!shutdown) {
+            std::vector<pollfd> polled = { { listen_fd, POLLIN, 0 } };
+            Clock::time_point now = Clock::now(), wake = Clock::time_point::max();
+            for (const PendingRequest& request : pending) {
+                polled.push_back({ request.fd, POLLIN, 0 });
+                wake = std::min(wake, request.deadline);
+            }
+            int timeout = -1;
+            if (!pending.empty()) {
+                timeout = int(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count() + 1));
+            }
+            if (poll(polled.data(), polled.size(), timeout) < 0) {
+                if (errno == EINTR) continue;
+                std::cerr << "Error: poll failed: " << strerror(errno) << std::endl;
+                break;
+            }
+            now = Clock::now();
+            std::vector<PendingRequest> still_pending;
+            for (size_t i = 0; i < pending.size(); i++) {
+                PendingRequest& request = pending[i];
+                ReadState state = polled[i + 1].revents ? read_request(request) : ReadState::More;
+                if (state == ReadState::More && now >= request.deadline) state = ReadState::Failed;
+                if (state == ReadState::More) {
+                    still_pending.push_back(std::move(request));
+                }
+                else if (state == ReadState::Failed) {
+                    send_error(request.fd, "incomplete request");
+                    close(request.fd);
+                }
+                else if (state == ReadState::Broken) {
+                    close(request.fd);
+                }
+                else if (!request.lines.empty() && request.lines.back() == "ping") {
+                    send_all(request.fd, "ok 0\n", 5);
+                    close(request.fd);
+                }
+                else if (!request.lines.empty() && request.lines.back() == "shutdown") {
+                    send_all(request.fd, "ok 0\n", 5);
+                    close(request.fd);
+                    shutdown = true;
+                }
+                else {
+                    enqueue(request.fd, request.lines);
+                }
+            }
+            pending.swap(still_pending);
+            if (polled[0].revents & POLLIN) {
+                int fd = accept(listen_fd, nullptr, nullptr);
+                if (fd >= 0) {
+                    PendingRequest request;
+                    request.fd = fd;
+                    request.deadline = now + request_time;
+                    pending.push_back(std::move(request));
+                }
+                else if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
+                    std::cerr << "Error: accept failed: " << strerror(errno) << std::endl;
+                    break;
+                }
+            }
+        }
+        for (const PendingRequest& request : pending) {
+            send_error(request.fd, "the server is shutting down");
+            close(request.fd);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            job_ready.notify_one();
+        }
+        renderer.join();
+        ImageWriterStats stats = writer.finish();
+        std::cout << "Served " << stats.images << " images (" << stats.failed << " failed), encode " << stats.encode_ms << " ms" << std::endl;
+    }
+
+private:
+    // Parses a complete request and queues it for the render thread, which answers on fd
+    void enqueue(int fd, const std::vector<std::string>& lines) {
+        Job job;
+        std::string error;
+        if (!parse_job(lines, job, error)) {
+            send_error(fd, error);
+            close(fd);
+            return;
+        }
+        job.fd = fd;
+        job.queued = Clock::now();
+        job.options.threads = threads;
+        std::lock_guard<std::mutex> lock(mutex);
+        job.sequence = next_sequence++;
+        jobs.push(std::move(job));
+        job_ready.notify_one();
+    }
+
+    void render_jobs() {
+        for (;;) {
+            Job job;
+            size_t waiting;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                job_ready.wait(lock, [&]() { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = jobs.top();
+                jobs.pop();
+                waiting = jobs.size();
+            }
+            auto start = Clock::now();
+            std::chrono::duration<double, std::milli> queue_time = start - job.queued;
+            bool hit;
+            LoadedScene loaded = scenes.get(job.scene, hit);
+            if (!loaded.scene) {
+                send_error(job.fd, "can not load scene " + describe(job.scene));
+                close(job.fd);
+                continue;
+            }
+            auto render_start = Clock::now();
+            std::chrono::duration<double, std::milli> load_time = render_start - start;
+            // Repeated jobs are answered with the JPEG in the render cache, without tracing or encoding
+            std::vector<Vec3uc> framebuffer;
+            std::vector<unsigned char> cached_jpeg;
+            Digest frame_key;
+            bool frame_hit = false;
+            if (disk) {
+                frame_key = hash_jpeg(hash_render(loaded.geometry, job.lights, job.options, envmap_stamp), job.quality);
+                frame_hit = disk->load_jpeg(frame_key, cached_jpeg);
+            }
+            if (!frame_hit) framebuffer = render(*loaded.scene, job.lights, job.options);
+            std::chrono::duration<double, std::milli> render_time = Clock::now() - render_start;
+            std::cout << "Job " << job.sequence << ": priority " << job.priority << ", " << job.options.width << "x" << job.options.height
+                << ", scene " << describe(job.scene) << (hit ? " (cached)" : "") << ", queued " << queue_time.count() << " ms, load "
+                << load_time.count() << " ms, " << (frame_hit ? "render cache hit " : "render ") << render_time.count() << " ms, "
+                << waiting << " waiting" << std::endl;
+            if (frame_hit) {
+                send_image(job.fd, cached_jpeg);
+                close(job.fd);
+            }
+            else {
+                const int fd = job.fd;
+                RenderCache* cache = disk;
+                writer.encode_jpg(job.options.width, job.options.height, std::move(framebuffer), job.quality,
+                    [fd, cache, frame_key](bool ok, const std::vector<unsigned char>& jpeg) {
+                        if (ok) send_image(fd, jpeg);
+                        else send_error(fd, "encoding failed");
+                        close(fd);
+                        if (ok && cache) cache->store_jpeg(frame_key, jpeg);
+                    });
+            }
+            // Hits are written to the index once the queue runs dry, not after every job of a burst
+            if (disk && waiting == 0) disk->flush();
+        }
+    }
+
+    int threads;
+    ImageWriter writer;
+    SceneCache scenes;
+    RenderCache* disk;
+    FileStamp envmap_stamp = {};
+    std::mutex mutex;
+    std::condition_variable job_ready;
+    std::priority_queue<Job, std::vector<Job>, JobOrder> jobs;
+    uint64_t next_sequence = 0;
+    bool stopping = false;
+};
+
+}
+
+// Whole decimal number in [min, max], nothing else
+bool parse_flag(const char* text, long min, long max, int& value) {
+    char* end;
+    errno = 0;
+    const long parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || parsed < min || parsed > max) return false;
+    value = int(parsed);
+    return true;
+}
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [--socket PATH] [--threads N] [--encoders N] [--scene-cache N]"
+        " [--envmap-lookup exact|cube] [--envmap-cache FILE] [--cache DIR] [--cache-size MB] [--trace FILE]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    const char* socket_path = "raytracer.sock";
+    const char* envmap_cache = nullptr;
+    const char* trace_path = nullptr;
+    const char* cache_dir = nullptr;
+    int cache_mb = 1024;
+    EnvmapLookup envmap_lookup = EnvmapLookup::Cube;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    int encoders = 1;
+    int scene_cache = 4;
+    for (int a = 1; a < argc; a++) {
+        if (a + 1 >= argc) {
+            print_usage(argv[0]);
+            return -1;
+        }
+        // Numbers are checked as strictly as the settings of a job
+        const char* flag = argv[a];
+        const char* expected = nullptr;
+        if (!strcmp(flag, "--socket")) socket_path = argv[++a];
+        else if (!strcmp(flag, "--threads")) {
+            if (!parse_flag(argv[++a], 1, 1024, threads)) expected = "a number of threads from 1 to 1024";
+        }
+        else if (!strcmp(flag, "--encoders")) {
+            if (!parse_flag(argv[++a], 1, 64, encoders)) expected = "a number of encoders from 1 to 64";
+        }
+        else if (!strcmp(flag, "--scene-cache")) {
+            if (!parse_flag(argv[++a], 0, 1024, scene_cache)) expected = "a number of scenes from 0 to 1024";
+        }
+        else if (!strcmp(flag, "--envmap-cache")) envmap_cache = argv[++a];
+        else if (!strcmp(flag, "--trace")) trace_path = argv[++a];
+        else if (!strcmp(flag, "--cache")) cache_dir = argv[++a];
+        else if (!strcmp(flag, "--cache-size")) {
+            if (!parse_flag(argv[++a], 1, 1 << 20, cache_mb)) expected = "a number of megabytes from 1 to 1048576";
+        }
+        else if (!strcmp(argv[a], "--envmap-lookup")) {
+            const char* lookup = argv[++a];
+            if (!strcmp(lookup, "exact")) envmap_lookup = EnvmapLookup::Exact;
+            else if (!strcmp(lookup, "cube")) envmap_lookup = EnvmapLookup::Cube;
+            else {
+                print_usage(argv[0]);
+                return -1;
+            }
+        }
+        else {
+            print_usage(argv[0]);
+            return -1;
+        }
+        if (expected) {
+            std::cerr << "Error: " << flag << " expects " << expected << std::endl;
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (trace_path) start_trace();
+    RenderCache render_cache;
+    if (cache_dir && !render_cache.open(cache_dir, uint64_t(cache_mb) << 20)) return -1;
+    bool envmap_from_cache = false;
+    if (envmap_cache) {
+        if (!envmap.load_cached("envmap.jpg", envmap_cache, envmap_lookup == EnvmapLookup::Cube, threads, envmap_from_cache)) return -1;
+    }
+    else {
+        if (!envmap.load("envmap.jpg")) return -1;
+        if (envmap_lookup == EnvmapLookup::Cube) envmap.build_cube(0, threads);
+    }
+    envmap.lookup = envmap_lookup;
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        std::cerr << "Error: socket path " << socket_path << " is too long" << std::endl;
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        std::cerr << "Error: can not create a socket: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    // A socket file left behind by an earlier server would make bind fail. It is only removed when nobody accepts
+    // connections on it, a running server keeps its socket. The probe sends "ping", so the running server does
+    // not take it for an empty job.
+    struct stat socket_stat;
+    if (lstat(socket_path, &socket_stat) == 0 && S_ISSOCK(socket_stat.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        const bool listening = probe >= 0 && connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+        const bool stale = !listening && errno == ECONNREFUSED;
+        if (listening) send_all(probe, "ping\n", 5);
+        if (probe >= 0) close(probe);
+        if (listening) {
+            std::cerr << "Error: a server is already listening on " << socket_path << std::endl;
+            close(listen_fd);
+            return -1;
+        }
+        if (stale) unlink(socket_path);
+    }
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(listen_fd, 64) < 0) {
+        std::cerr << "Error: can not listen on " << socket_path << ": " << strerror(errno) << std::endl;
+        close(listen_fd);
+        return -1;
+    }
+    // Clients that hang up early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    std::cout << "Listening on " << socket_path << " with " << threads << " threads" << std::endl;
+
+    Server server(threads, encoders, size_t(scene_cache), cache_dir ? &render_cache : nullptr);
+    server.serve(listen_fd);
+    close(listen_fd);
+    unlink(socket_path);
+
+    if (trace_path) {
+        if (!write_trace(trace_path)) return -1;
+        std::cout << "Trace: " << trace_path << std::endl;
+    }
+    return 0;
+}
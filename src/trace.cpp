@@ -0,0 +1,135 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "trace.h"
+
+std::atomic<bool> trace_recording(false);
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Events of one OS thread, appended without locking. The buffers outlive their threads until the trace is written.
+// Threads that never record an event, like idle workers of the pool, only cost the empty buffer.
+struct ThreadTrace {
+    int tid;
+    std::vector<TraceEvent> events;
+};
+
+struct TraceState {
+    std::mutex mutex;
+    Clock::time_point start;
+    std::vector<std::unique_ptr<ThreadTrace>> threads;
+    // Track of every thread name, in the order they were first used
+    std::map<std::string, int> named_tids;
+    std::vector<std::string> names;
+    int next_tid = 1;
+};
+
+TraceState& state() {
+    static TraceState s;
+    return s;
+}
+
+thread_local ThreadTrace* local_trace = nullptr;
+
+ThreadTrace& thread_trace() {
+    if (!local_trace) {
+        TraceState& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.threads.emplace_back(new ThreadTrace());
+        local_trace = s.threads.back().get();
+        local_trace->tid = s.next_tid++;
+    }
+    return *local_trace;
+}
+
+void write_json_string(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+}
+
+void start_trace() {
+    state().start = Clock::now();
+    trace_recording.store(true);
+    trace_thread_name("main");
+}
+
+int64_t trace_clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - state().start).count();
+}
+
+void trace_record(const TraceEvent& event) {
+    thread_trace().events.push_back(event);
+}
+
+void trace_thread_name(const char* name) {
+    if (!trace_recording.load(std::memory_order_relaxed)) return;
+    ThreadTrace& trace = thread_trace();
+    TraceState& s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto named = s.named_tids.find(name);
+    if (named == s.named_tids.end()) {
+        named = s.named_tids.insert({ name, trace.tid }).first;
+        s.names.push_back(name);
+    }
+    trace.tid = named->second;
+}
+
+bool write_trace(const char* path) {
+    TraceState& s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        std::cerr << "Error: can not write " << path << std::endl;
+        return false;
+    }
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    // Tracks are sorted by their tid, which follows the order threads were named in
+    for (const std::string& name : s.names) {
+        fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": ", first ? "" : ",\n", s.named_tids[name]);
+        write_json_string(f, name.c_str());
+        fprintf(f, "}},\n{\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"sort_index\": %d}}",
+            s.named_tids[name], s.named_tids[name]);
+        first = false;
+    }
+    for (const std::unique_ptr<ThreadTrace>& thread : s.threads) {
+        for (const TraceEvent& event : thread->events) {
+            fprintf(f, "%s{\"name\": ", first ? "" : ",\n");
+            write_json_string(f, event.name);
+            fprintf(f, ", \"cat\": ");
+            write_json_string(f, event.category);
+            fprintf(f, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f", thread->tid, event.start_ns * 1e-3, event.duration_ns * 1e-3);
+            if (event.arg_count) {
+                fprintf(f, ", \"args\": {");
+                for (int a = 0; a < event.arg_count; a++) {
+                    fprintf(f, "%s", a ? ", " : "");
+                    write_json_string(f, event.arg_keys[a]);
+                    fprintf(f, ": %lld", (long long)event.arg_values[a]);
+                }
+                fprintf(f, "}");
+            }
+            fprintf(f, "}");
+            first = false;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) {
+        std::cerr << "Error: can not write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
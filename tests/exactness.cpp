@@ -0,0 +1,426 @@
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "animation.h"
+#include "envmap.h"
+#include "render_cache.h"
+#include "renderer.h"
+#include "scene_file.h"
+#include "scheduler.h"
+#include "stb_image_write.h"
+
+// Every alternative path through the renderer has to produce the same image, byte for byte: the SIMD sphere
+// kernels, packets, the wavefront integrator, mapped scene files, BVH refits and the render cache. Each check
+// renders small scenes both ways and compares the framebuffers. The kernels and the watertight triangle test
+// are also compared directly against scalar references.
+//
+// Usage: raytracer_tests [kernels|triangles|simd|paths|scene_file|refit|cache], all checks without an argument.
+// Files are written to the working directory.
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (ok) return;
+    std::cerr << "FAILED: " << what << std::endl;
+    failures++;
+}
+
+void check_same(const std::vector<Vec3uc>& expected, const std::vector<Vec3uc>& actual, int width, const std::string& what) {
+    if (expected.size() != actual.size()) {
+        check(false, what + ": framebuffer sizes differ");
+        return;
+    }
+    for (size_t p = 0; p < expected.size(); p++) {
+        if (expected[p][0] != actual[p][0] || expected[p][1] != actual[p][1] || expected[p][2] != actual[p][2]) {
+            check(false, what + ": first difference at pixel " + std::to_string(p % width) + " " + std::to_string(p / width));
+            return;
+        }
+    }
+}
+
+bool same_float(float a, float b) {
+    return !memcmp(&a, &b, sizeof(float));
+}
+
+// Small gradient with a few hard edges, written to disk and loaded like envmap.jpg
+bool load_test_envmap() {
+    const int width = 64, height = 32;
+    std::vector<unsigned char> pixels(width * height * 3);
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            unsigned char* p = &pixels[(i + j * width) * 3];
+            p[0] = (unsigned char)(i * 4);
+            p[1] = (unsigned char)(j * 8);
+            p[2] = ((i / 8 + j / 8) % 2) ? 220 : 40;
+        }
+    }
+    if (!stbi_write_png("test_envmap.png", width, height, 3, pixels.data(), width * 3)) {
+        std::cerr << "Error: can not write test_envmap.png" << std::endl;
+        return false;
+    }
+    if (!envmap.load("test_envmap.png")) return false;
+    envmap.build_cube(16, 1);
+    envmap.lookup = EnvmapLookup::Cube;
+    return true;
+}
+
+// n x n quads with random heights behind the spheres, every inner edge and vertex shared
+TriangleMesh make_grid_mesh(int n, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> height(-1.5f, 1.5f);
+    TriangleMesh mesh;
+    for (int j = 0; j <= n; j++) {
+        for (int i = 0; i <= n; i++) mesh.vertices.push_back(Vec3f(-9.f + 18.f * i / n, -7.f + 14.f * j / n, -24.f + height(rng)));
+    }
+    for (int j = 0; j < n; j++) {
+        for (int i = 0; i < n; i++) {
+            const uint32_t a = j * (n + 1) + i, b = a + 1, c = a + n + 1, d = c + 1;
+            for (uint32_t index : { a, b, d, a, d, c }) mesh.indices.push_back(index);
+        }
+    }
+    return mesh;
+}
+
+Scene make_test_scene(int spheres, unsigned seed) {
+    Scene scene = make_random_scene(spheres, seed);
+    TriangleMesh mesh = make_grid_mesh(12, seed);
+    mesh.material = scene.add_material(Material(Vec3f(0.4, 0.4, 0.3), 0.6, 0.3, 50., 0.1, 0.0, 1.0));
+    scene.meshes.push_back(std::move(mesh));
+    scene.build_bvh();
+    return scene;
+}
+
+// Not a multiple of the tile or packet size, so partial tiles and packets are covered
+RenderOptions test_options() {
+    RenderOptions options;
+    options.width = 100;
+    options.height = 70;
+    options.threads = 1;
+    return options;
+}
+
+std::vector<SimdIsa> available_isas() {
+    std::vector<SimdIsa> isas = { SimdIsa::Scalar };
+#ifdef RT_X86
+    isas.push_back(SimdIsa::SSE2);
+    if (cpu_has_avx2()) isas.push_back(SimdIsa::AVX2);
+#endif
+    return isas;
+}
+
+// The SoA kernels against Sphere::ray_intersect, over every count of spheres up to a few vectors and every offset
+void test_kernels() {
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> unit(-1.f, 1.f), radius(0.2f, 1.5f);
+    const uint32_t total = 24;
+    for (int trial = 0; trial < 400; trial++) {
+        std::vector<Sphere> spheres;
+        SphereSoA soa;
+        for (uint32_t i = 0; i < total; i++) {
+            // Some duplicates, so ties between equal distances are exercised
+            if (i > 0 && trial % 5 == 0 && i % 7 == 0) spheres.push_back(spheres.back());
+            else spheres.push_back(Sphere(Vec3f(3 * unit(rng), 3 * unit(rng), -6 + 4 * unit(rng)), radius(rng), 0));
+            soa.push_back(spheres.back().center, spheres.back().radius);
+        }
+        soa.pad();
+        // Every tenth ray starts inside a sphere
+        Vec3f ro = trial % 10 == 0 ? spheres[trial % total].center : Vec3f(unit(rng), unit(rng), unit(rng));
+        Vec3f rd = Vec3f(0.4f * unit(rng), 0.4f * unit(rng), -1.f).normalize();
+        const float max_dist = 2.f + 8.f * (unit(rng) + 1.f) * 0.5f;
+        for (uint32_t count = 1; count <= 19; count++) {
+            const uint32_t first = uint32_t(trial) % (total - count + 1);
+            int expected = -1;
+            float expected_t = 0;
+            bool expected_occluded = false;
+            for (uint32_t i = first; i < first + count; i++) {
+                float t;
+                if (!spheres[i].ray_intersect(ro, rd, t)) continue;
+                if (expected < 0 || t < expected_t) {
+                    expected = int(i);
+                    expected_t = t;
+                }
+                expected_occluded = expected_occluded || t < max_dist;
+            }
+            for (SimdIsa isa : available_isas()) {
+                const SphereKernels kernels = sphere_kernels(isa);
+                const std::string what = std::string(simd_isa_name(isa)) + " kernel, trial " + std::to_string(trial) + ", "
+                    + std::to_string(count) + " spheres from " + std::to_string(first);
+                float t;
+                const int closest = kernels.closest(soa, first, count, ro, rd, t);
+                check(closest == expected && (closest < 0 || same_float(t, expected_t)), what + ": closest hit");
+                check(kernels.occluded(soa, first, count, ro, rd, max_dist) == expected_occluded, what + ": occlusion");
+            }
+        }
+    }
+}
+
+void test_triangles() {
+    const Vec3f a(0, 0, -1), b(1, 0, -1), c(0, 1, -1);
+    const WatertightRay ray(Vec3f(0, 0, 0), Vec3f(0.25f, 0.25f, -1.f));
+    float t = 0, u = 0, v = 0;
+    check(ray.intersect(a, b, c, 10.f, t, u, v) && fabsf(t - 1.f) < 1e-6f && fabsf(u - 0.25f) < 1e-6f && fabsf(v - 0.25f) < 1e-6f,
+        "triangle hit with its distance and barycentrics");
+    check(ray.intersect(a, c, b, 10.f, t, u, v) && fabsf(t - 1.f) < 1e-6f, "triangle hit from the back");
+    check(!ray.intersect(a, b, c, 0.5f, t, u, v), "triangle beyond t_max");
+    check(!WatertightRay(Vec3f(0, 0, -2), Vec3f(0.25f, 0.25f, -1.f)).intersect(a, b, c, 10.f, t, u, v), "triangle behind the ray");
+    check(!WatertightRay(Vec3f(0, 0, 0), Vec3f(0.75f, 0.75f, -1.f)).intersect(a, b, c, 10.f, t, u, v), "ray passing the triangle");
+
+    // Rays aimed at the shared spokes and center of a non-planar fan must hit at least one of its triangles. The fan
+    // is kept flat enough that no spoke is a silhouette edge seen from the ray origins.
+    std::mt19937 rng(2);
+    std::uniform_real_distribution<float> unit(-1.f, 1.f);
+    const int ring = 7;
+    std::vector<Vec3f> fan = { Vec3f(0.1f, -0.2f, -5.f) };
+    for (int k = 0; k < ring; k++) {
+        const float angle = 2.f * float(M_PI) * k / ring;
+        fan.push_back(Vec3f(2.f * cosf(angle), 2.f * sinf(angle), -5.f + 0.3f * unit(rng)));
+    }
+    int misses = 0;
+    for (int trial = 0; trial < 20000; trial++) {
+        const int spoke = 1 + trial % ring;
+        const float along = trial % 50 == 0 ? 0.f : (unit(rng) + 1.f) * 0.5f;
+        const Vec3f target = fan[0] + (fan[spoke] - fan[0]) * along;
+        const Vec3f ro(1.5f * unit(rng), 1.5f * unit(rng), 2 * unit(rng));
+        const WatertightRay fan_ray(ro, target - ro);
+        bool hit = false;
+        for (int k = 0; k < ring && !hit; k++) hit = fan_ray.intersect(fan[0], fan[1 + k], fan[1 + (k + 1) % ring], 10.f, t, u, v);
+        if (!hit) misses++;
+    }
+    check(misses == 0, std::to_string(misses) + " rays slipped through shared edges of a triangle fan");
+
+    // The mesh BVH has to find the same closest hit as testing every triangle
+    TriangleMesh mesh = make_grid_mesh(16, 3);
+    mesh.build_bvh();
+    for (int trial = 0; trial < 5000; trial++) {
+        const Vec3f ro(2 * unit(rng), 2 * unit(rng), 2 * unit(rng));
+        const Vec3f rd = Vec3f(0.5f * unit(rng), 0.4f * unit(rng), -1.f).normalize();
+        const WatertightRay brute(ro, rd);
+        float expected_t = 100.f;
+        bool expected_hit = false;
+        for (size_t tri = 0; tri < mesh.triangle_count(); tri++) {
+            if (brute.intersect(mesh.vertices[mesh.indices[3 * tri]], mesh.vertices[mesh.indices[3 * tri + 1]], mesh.vertices[mesh.indices[3 * tri + 2]],
+                    expected_t, t, u, v)) {
+                expected_t = t;
+                expected_hit = true;
+            }
+        }
+        float t_max = 100.f;
+        uint32_t triangle;
+        const bool hit = mesh.intersect(ro, rd, t_max, triangle, u, v);
+        check(hit == expected_hit && (!hit || same_float(t_max, expected_t)), "mesh BVH closest hit, ray " + std::to_string(trial));
+        check(mesh.occluded(ro, rd, 24.f) == (expected_hit && expected_t < 24.f), "mesh BVH occlusion, ray " + std::to_string(trial));
+    }
+}
+
+void test_simd() {
+    const Scene scene = make_test_scene(300, 4);
+    const std::vector<Light> lights = make_demo_lights();
+    const RenderOptions options = test_options();
+    const SphereKernels active = active_sphere_kernels();
+    set_sphere_kernels(SimdIsa::Scalar);
+    const std::vector<Vec3uc> expected = render(scene, lights, options);
+    for (SimdIsa isa : available_isas()) {
+        set_sphere_kernels(isa);
+        check_same(expected, render(scene, lights, options), options.width, std::string(simd_isa_name(isa)) + " kernels");
+    }
+    active_sphere_kernels() = active;
+}
+
+void test_paths() {
+    const Scene scene = make_test_scene(200, 5);
+    const std::vector<Light> lights = make_demo_lights();
+    const RenderOptions options = test_options();
+    const std::vector<Vec3uc> expected = render(scene, lights, options);
+
+    RenderOptions single = options;
+    single.packets = false;
+    check_same(expected, render(scene, lights, single), options.width, "single rays");
+    RenderOptions threaded = options;
+    threaded.threads = 3;
+    threaded.tile_size = 7;
+    check_same(expected, render(scene, lights, threaded), options.width, "3 threads with 7 pixel tiles");
+    // Parallel calls from inside a job, on the calling thread and on the workers, run serially on their thread
+    std::vector<int> inner(8, 0);
+    parallel_for_stealing(8, 3, [&](int, int outer) {
+        parallel_for_stealing(16, 3, [&](int worker, int) { inner[outer] += worker == 0 ? 1 : 100; });
+    });
+    check(inner == std::vector<int>(8, 16), "nested parallel_for_stealing");
+    for (int tile_size : { 16, 33 }) {
+        RenderOptions wavefront = options;
+        wavefront.integrator = Integrator::Wavefront;
+        wavefront.tile_size = tile_size;
+        check_same(expected, render(scene, lights, wavefront), options.width, "wavefront with " + std::to_string(tile_size) + " pixel tiles");
+    }
+}
+
+void test_scene_file() {
+    const Scene scene = make_test_scene(200, 6);
+    const std::vector<Light> lights = make_demo_lights();
+    const RenderOptions options = test_options();
+    Scene mapped, remapped;
+    if (!write_scene("test_scene.rts", scene) || !map_scene("test_scene.rts", mapped)) {
+        check(false, "writing and mapping a scene file");
+        return;
+    }
+    check_same(render(scene, lights, options), render(mapped, lights, options), options.width, "mapped scene file");
+    // A mapped scene written again gives the same file, so the same digest
+    check(write_scene("test_scene2.rts", mapped) && map_scene("test_scene2.rts", remapped) && mapped.file_digest == remapped.file_digest,
+        "digest of a rewritten scene file");
+
+    // Files whose sections fit but whose nodes or indices point outside the arrays are rejected
+    // Through a const reference, so the buffers stay views into the mapping
+    const Scene& view = mapped;
+    const uint8_t* file = view.mapping->data();
+    const std::vector<uint8_t> bytes(file, file + view.mapping->size());
+    const size_t root = size_t(reinterpret_cast<const uint8_t*>(view.bvh.nodes.data()) - file);
+    const size_t prim_index = size_t(reinterpret_cast<const uint8_t*>(view.bvh.prim_indices.data()) - file);
+    auto rejects = [&](size_t offset, uint32_t value, const char* what) {
+        std::vector<uint8_t> corrupt = bytes;
+        memcpy(corrupt.data() + offset, &value, sizeof(value));
+        FILE* f = fopen("test_corrupt.rts", "wb");
+        bool written = f && fwrite(corrupt.data(), 1, corrupt.size(), f) == corrupt.size();
+        if (f) written = fclose(f) == 0 && written;
+        Scene scene;
+        check(written && !map_scene("test_corrupt.rts", scene), what);
+    };
+    rejects(root + offsetof(BVHNode, left_first), 0, "scene file whose root is its own child");
+    rejects(root + offsetof(BVHNode, left_first), uint32_t(view.bvh.nodes.size()), "scene file with a child past the nodes");
+    rejects(prim_index, uint32_t(view.bvh.prim_indices.size()), "scene file with a sphere index past the spheres");
+}
+
+void test_refit() {
+    const char* path = "test_animation.txt";
+    {
+        std::ofstream out(path);
+        out << "group front 0 100\n1 rotate all 0 1 0 25 0 0 -30\n1 translate front 0 1 0\n2 12 1 2 -20\n3 rotate all 1 1 0 -40\n";
+    }
+    Scene refitted = make_test_scene(300, 7), rebuilt = make_test_scene(300, 7);
+    Animation refit_animation, rebuild_animation;
+    if (!load_animation(path, refitted.sphere_count(), refit_animation) || !load_animation(path, rebuilt.sphere_count(), rebuild_animation)) {
+        check(false, "loading " + std::string(path));
+        return;
+    }
+    const std::vector<Light> lights = make_demo_lights();
+    const RenderOptions options = test_options();
+    for (uint32_t frame = 0; frame < refit_animation.frame_count; frame++) {
+        const size_t moved = refit_animation.apply(frame, refitted);
+        check(rebuild_animation.apply(frame, rebuilt) == moved, "spheres moved in frame " + std::to_string(frame));
+        if (moved) {
+            refitted.refit_sphere_bvh();
+            rebuilt.build_sphere_bvh();
+        }
+        // Most spheres are off screen, so their SoA entries are compared as well
+        std::vector<Vec3f> refitted_centers(refitted.sphere_count()), rebuilt_centers(rebuilt.sphere_count());
+        for (size_t k = 0; k < refitted.sphere_count(); k++) {
+            const SphereSoA& a = refitted.sphere_soa;
+            const SphereSoA& b = rebuilt.sphere_soa;
+            refitted_centers[refitted.bvh.prim_indices[k]] = Vec3f(a.center_x[k], a.center_y[k], a.center_z[k]);
+            rebuilt_centers[rebuilt.bvh.prim_indices[k]] = Vec3f(b.center_x[k], b.center_y[k], b.center_z[k]);
+        }
+        bool same_centers = true;
+        for (size_t i = 0; i < refitted_centers.size(); i++) {
+            same_centers = same_centers && same_float(refitted_centers[i].x, rebuilt_centers[i].x)
+                && same_float(refitted_centers[i].y, rebuilt_centers[i].y) && same_float(refitted_centers[i].z, rebuilt_centers[i].z);
+        }
+        check(same_centers, "refitted sphere centers in frame " + std::to_string(frame));
+        check_same(render(rebuilt, lights, options), render(refitted, lights, options), options.width, "refit in frame " + std::to_string(frame));
+    }
+}
+
+void test_cache() {
+    const Scene scene = make_test_scene(150, 8);
+    const std::vector<Light> lights = make_demo_lights();
+    const RenderOptions options = test_options();
+    const Digest geometry = hash_geometry(scene);
+    check(hash_geometry(make_test_scene(150, 8)) == geometry, "geometry hash of the same scene");
+    check(!(hash_geometry(make_test_scene(150, 9)) == geometry), "geometry hash of another scene");
+
+    FileStamp envmap_stamp = {};
+    file_stamp("test_envmap.png", envmap_stamp);
+    const Digest key = hash_render(geometry, lights, options, envmap_stamp);
+    RenderOptions same = options;
+    same.threads = 3;
+    same.packets = false;
+    same.integrator = Integrator::Wavefront;
+    check(hash_render(geometry, lights, same, envmap_stamp) == key, "render hash ignores threads, packets and the integrator");
+    RenderOptions other = options;
+    other.fov = 50.f;
+    check(!(hash_render(geometry, lights, other, envmap_stamp) == key), "render hash of another field of view");
+    const Digest jpeg_key = hash_jpeg(key, 100);
+    check(!(hash_jpeg(key, 90) == jpeg_key), "JPEG key of another quality");
+
+    // Leftovers of an earlier run would turn the misses below into hits
+    remove(("test_cache/" + jpeg_key.hex() + ".jpg").c_str());
+    remove(("test_cache/" + geometry.hex() + ".scene").c_str());
+    const std::vector<Vec3uc> expected = render(scene, lights, options);
+    std::vector<unsigned char> jpeg;
+    stbi_write_jpg_to_func([](void* context, void* data, int size) {
+        std::vector<unsigned char>& out = *static_cast<std::vector<unsigned char>*>(context);
+        out.insert(out.end(), static_cast<unsigned char*>(data), static_cast<unsigned char*>(data) + size);
+    }, &jpeg, options.width, options.height, 3, expected.data(), 100);
+    {
+        RenderCache cache;
+        if (!cache.open("test_cache", 64 << 20)) {
+            check(false, "opening test_cache");
+            return;
+        }
+        std::vector<unsigned char> cached;
+        check(!cache.load_jpeg(jpeg_key, cached), "render cache miss");
+        cache.store_jpeg(jpeg_key, jpeg);
+        check(cache.load_jpeg(jpeg_key, cached) && cached == jpeg, "JPEG from the render cache");
+
+        Scene mapped;
+        check(!cache.load_scene(geometry, mapped), "scene cache miss");
+        cache.store_scene(geometry, scene);
+        check(cache.load_scene(geometry, mapped), "scene cache hit");
+        check_same(expected, render(mapped, lights, options), options.width, "scene from the render cache");
+        Scene mapped_again;
+        check(cache.load_scene(geometry, mapped_again) && hash_geometry(mapped_again) == hash_geometry(mapped), "geometry hash of a mapped scene");
+    }
+    // The hits above are written to the index when the cache is destroyed
+    RenderCache reopened;
+    std::vector<unsigned char> cached;
+    check(reopened.open("test_cache", 64 << 20) && reopened.load_jpeg(jpeg_key, cached) && cached == jpeg, "render cache hit after reopening");
+}
+
+struct Test {
+    const char* name;
+    void (*run)();
+};
+
+const Test tests[] = {
+    { "kernels", test_kernels },
+    { "triangles", test_triangles },
+    { "simd", test_simd },
+    { "paths", test_paths },
+    { "scene_file", test_scene_file },
+    { "refit", test_refit },
+    { "cache", test_cache },
+};
+
+}
+
+int main(int argc, char** argv) {
+    if (!load_test_envmap()) return -1;
+    bool found = false;
+    for (const Test& test : tests) {
+        if (argc > 1 && strcmp(argv[1], test.name)) continue;
+        found = true;
+        const int before = failures;
+        test.run();
+        std::cout << test.name << ": " << (failures == before ? "ok" : "FAILED") << std::endl;
+    }
+    if (!found) {
+        std::cerr << "Usage: " << argv[0] << " [kernels|triangles|simd|paths|scene_file|refit|cache]" << std::endl;
+        return -1;
+    }
+    return failures ? 1 : 0;
+}